@@ -40,15 +40,29 @@ See
 - https://stackoverflow.com/questions/42138764/marshaling-object-code-for-a-numba-function
 """
 
+import collections
 import ctypes
 from collections import OrderedDict as odict
 import functools
+import hashlib
+import cPickle
+import inspect
+import json
+import multiprocessing
 import os
 import re
 import string
 import struct
+import subprocess
+import sys
+import threading
 
 from cstruct import Struct
+from epyccrt import (tuplize, deepcopy_list, byte_ctypes, buffer_types, ReadOnlyBuffer, 
+    get_buffer_pointer, marshal_args, copy_back_args, marshal_wrapper, LatencyHistogram, 
+    latency_wrapper, ArenaHeader, Arena, get_thread_arena, arena_wrapper, closed_function, 
+    encode_function_signatures, decode_function_signatures, bind_functions)
+import grammar
 
 import lark
 # Monkey patch lark trees so they can compare to strings, see 
@@ -157,6 +171,18 @@ class SymbolTable():
     def __len__(self):
         return len(self.scope_symbols) - 1
 
+    def get_depth(self, key):
+        """
+        Return the number of scopes up to and including the scope the key is
+        defined in, None if the key is not defined (the current scope is
+        len(self), the global scope is 1)
+        """
+        for i in xrange(len(self.scope_symbols) - 2, -1, -1):
+            if (key in self.scope_symbols[i]):
+                return i + 1
+
+        return None
+
     def values(self):
         return self.scope_symbols[-2].values()
 
@@ -182,6 +208,87 @@ class SymbolTable():
         self.scope_symbols[-1] = dict()
 
 
+c_simple_escapes = {
+    "'" : "'", '"' : '"', "?" : "?", "\\" : "\\", 
+    "a" : "\a", "b" : "\b", "f" : "\f", "n" : "\n", "r" : "\r", "t" : "\t", "v" : "\v",
+}
+
+def decode_c_escapes(s, wide = False):
+    """
+    Return the bytes of the contents of a C character constant or string
+    literal with the escape sequences decoded, universal character names are
+    encoded as UTF-8
+
+    If wide is True, return the list of code points of the contents of a wide
+    character constant or string literal instead, the source characters are
+    decoded as UTF-8 and the octal, hexadecimal and universal character name
+    escapes are the code points themselves
+    """
+    chars = []
+    i = 0
+    while (i < len(s)):
+        c = s[i]
+        if (c != "\\"):
+            chars.append(c)
+            i += 1
+            continue
+
+        c = s[i + 1]
+        if (c in c_simple_escapes):
+            chars.append(c_simple_escapes[c])
+            i += 2
+
+        elif (c in "01234567"):
+            # octal-escape-sequence, up to three digits
+            digits = re.match("[0-7]{1,3}", s[i + 1:]).group(0)
+            if (wide):
+                chars.append(int(digits, 8))
+            else:
+                chars.append(chr(int(digits, 8) & 0xff))
+            i += 1 + len(digits)
+
+        elif (c == "x"):
+            # hexadecimal-escape-sequence, as many digits as there are
+            digits = re.match("[0-9a-fA-F]+", s[i + 2:]).group(0)
+            if (wide):
+                chars.append(int(digits, 16) & 0xffffffff)
+            else:
+                chars.append(chr(int(digits, 16) & 0xff))
+            i += 2 + len(digits)
+
+        elif (c in "uU"):
+            # universal-character-name
+            # XXX unichr fails for characters outside the BMP on narrow
+            #     Python builds
+            num_digits = 4 if (c == "u") else 8
+            if (wide):
+                chars.append(int(s[i + 2:i + 2 + num_digits], 16))
+            else:
+                chars.append(unichr(int(s[i + 2:i + 2 + num_digits], 16)).encode("utf-8"))
+            i += 2 + num_digits
+
+        else:
+            assert False, "Unknown escape sequence \\%s" % c
+
+    if (not wide):
+        return string.join(chars, "")
+
+    # Decode runs of source characters as UTF-8, escapes are already code
+    # points
+    code_points = []
+    source_chars = []
+    for c in chars + [None]:
+        if (isinstance(c, str)):
+            source_chars.append(c)
+            continue
+
+        code_points.extend([ord(u) for u in string.join(source_chars, "").decode("utf-8")])
+        source_chars = []
+        if (c is not None):
+            code_points.append(c)
+
+    return code_points
+
 def get_fn_name(*args):
     """
     Return a function name based on the incoming arguments: operation name, 
@@ -206,6 +313,16 @@ def type_is_struct_or_union(t):
 def type_is_array(t):
     return isinstance(t, list)
 
+def type_is_strided_array(t):
+    """
+    @return True if the type is an array parameter declared with [*]
+            dimensions, which is passed as a base pointer plus the byte stride
+            of each dimension so non-contiguous views can be passed without
+            copying
+    """
+    return (isinstance(t, list) and isinstance(t[1], Struct) and 
+        (t[1].type == "strided"))
+
 def type_is_compile_time_sized_array(t):
     """
     @return True if the type is an array and its size is known at compile time
@@ -231,6 +348,14 @@ def get_array_item_type(t):
         
     return a_type
 
+def get_array_dims(t):
+    dims = []
+    while (type_is_array(t)):
+        t, dim = t
+        dims.append(dim)
+
+    return dims
+
 def build_type_from_dimensions(item_type, dims):
     # Convert from dimensions to nested array type, dimesions stay as ir nodes
     # (with a constant ir_reg or not), or None
@@ -422,6 +547,11 @@ def get_llvmlite_type(t):
         # XXX or typedef, but typedef not supported yet
         llvmlite_type = c_to_llvmlite_types[t]
 
+    elif (type_is_strided_array(t)):
+        # Strided array, a byte pointer since the address is calculated with
+        # byte strides
+        llvmlite_type = ir.IntType(8).as_pointer()
+
     elif (isinstance(t, list)):
         # Array or pointer
         if ((t[1] is not None) and (isinstance(t[1].ir_reg, ir.Constant))):
@@ -479,6 +609,11 @@ def get_ctype(t):
         # XXX Missing typedefs
         ctype = c_to_ctypes[t]
 
+    elif (type_is_strided_array(t)):
+        # Strided array base pointer, the strides are passed as extra
+        # parameters, see epycc_generate
+        ctype = ctypes.c_void_p
+
     elif (isinstance(t, list)):
         if ((t[1] is not None) and isinstance(t[1].ir_reg, ir.Constant)):
             # Compile-time sized array
@@ -498,10 +633,29 @@ def get_ctype(t):
     return ctype
 
 
+def get_clang_filepath():
+    """
+    Return the clang executable to use, in order of preference
+    - the EPYCC_CLANG environment variable
+    - a clang copied to _out/bin (see test_cfiles.py for the right version)
+    - clang in the PATH
+    """
+    clang_filepath = os.environ.get("EPYCC_CLANG", None)
+    if (clang_filepath is None):
+        # clang_filepath = R"C:\android-ndk-r15c\toolchains\llvm\prebuilt\windows-x86_64\bin\clang.exe"
+        for clang_filename in ["clang.exe", "clang"]:
+            filepath = os.path.join(os.path.dirname(os.path.abspath(__file__)), "_out", "bin", clang_filename)
+            if (os.path.exists(filepath)):
+                clang_filepath = filepath
+                break
+        else:
+            clang_filepath = "clang"
+
+    return clang_filepath
+
 def invoke_clang(c_filepath, ir_filepath, options=""):
     # Generate the precompiled IR in irs.ll
-    # clang_filepath = R"C:\android-ndk-r15c\toolchains\llvm\prebuilt\windows-x86_64\bin\clang.exe"
-    clang_filepath = os.path.join(os.path.dirname(os.path.abspath(__file__)), "_out", "bin", "clang.exe")
+    clang_filepath = get_clang_filepath()
     # For privacy reasons and since some ir files are pushed to the repo, don't
     # leak the local path in the LLVM moduleid comment of 
     cmd = R"%s -S -std=c99 -emit-llvm -mllvm --x86-asm-syntax=intel %s -o %s %s" % (
@@ -510,7 +664,21 @@ def invoke_clang(c_filepath, ir_filepath, options=""):
         os.path.relpath(ir_filepath),
         os.path.relpath(c_filepath)
     )
-    os.system(cmd)
+    return os.system(cmd)
+
+def invoke_clang_shared(c_filepath, so_filepath, options="-O2"):
+    """
+    Compile the C file into a shared object that can be loaded with
+    ctypes.CDLL, returns the command exit code
+    """
+    clang_filepath = get_clang_filepath()
+    cmd = R"%s -std=c99 -shared -fPIC %s -o %s %s" % (
+        clang_filepath,
+        options,
+        os.path.relpath(so_filepath),
+        os.path.relpath(c_filepath)
+    )
+    return os.system(cmd)
 
 def invoke_dot(filepath):
     dot_filepath = os.path.join(os.path.dirname(os.path.abspath(__file__)), "_out", "bin", "dot.exe")
@@ -522,21 +690,11 @@ def invoke_dot(filepath):
     os.system(cmd)
 
 
-def precompile_c_snippets(generated_c_filepath, generated_ir_filepath):
+def generate_c_snippets():
     """
-    Generate a file containing one C function implementing every C operation and
-    type.
-
-    The generated file can then be fed to a local clang install via
-
-        %CLANG% -mllvm -S -std=c99 --x86-asm-syntax=intel -emit-llvm -o- generated/irs.c
-
-    and generate LLVM IR that can be read from epycc to do the runtime codegen
-    (the -S is needed so clang doesn't error trying to generate object code)
-
+    Return a list of lines with one C function implementing every C operation
+    and type.
     """
-    print "Precompiling C snippets"
-
     l = []
 
     # Operations are done in the same type and then the result converted 
@@ -596,12 +754,76 @@ def precompile_c_snippets(generated_c_filepath, generated_ir_filepath):
                 )
                 l.append(fn + "\n")
 
+    return l
+
+def get_c_snippets_hash(lines):
+    """
+    Return the content hash of the C snippets lines, independent of the order
+    of the lines (which depends on set iteration order) and of the line
+    endings
+    """
+    return get_source_hash(string.join(sorted([line.rstrip() for line in lines]), "\n"))
+
+def precompile_c_snippets(generated_c_filepath, generated_ir_filepath, lines):
+    """
+    Generate a file containing the C snippets lines
+
+    The generated file can then be fed to a local clang install via
+
+        %CLANG% -mllvm -S -std=c99 --x86-asm-syntax=intel -emit-llvm -o- generated/irs.c
+
+    and generate LLVM IR that can be read from epycc to do the runtime codegen
+    (the -S is needed so clang doesn't error trying to generate object code)
+
+    """
+    print "Precompiling C snippets"
 
     # Generate the C functions file in irs.c
     with open(generated_c_filepath, "w") as f:
-        f.writelines(l)
+        f.writelines(lines)
+
+    exit_code = invoke_clang(generated_c_filepath, generated_ir_filepath)
+    assert exit_code == 0, "Failed to precompile C snippets with %s, exit code %d" % (
+        get_clang_filepath(), exit_code)
+
+# Lock protecting the lazy initialization of module state (LLVM, snippets IR,
+# self-hosted lexer) so epycc can compile from multiple threads. Reentrant
+# since some initializations compile and initialize others
+init_lock = threading.RLock()
+
+# Parsed IR of the C snippets, see get_c_snippets_ir
+c_snippets_ir = None
+
+def get_c_snippets_ir():
+    """
+    Return the parsed IR of the C snippets, see generate_c_snippets.
+
+    The IR is shipped precompiled in generated/irs.ll next to the C source it
+    was compiled from in generated/irs.c. It's only recompiled with clang if
+    the content of the C snippets changed, so normal use never depends on
+    clang. The parsed IR is cached for the lifetime of the process
+    """
+    global c_snippets_ir
+    with init_lock:
+        if (c_snippets_ir is None):
+            epycc_dirpath = os.path.dirname(os.path.abspath(__file__))
+            generated_c_filepath = os.path.join(epycc_dirpath, "generated", "irs.c")
+            generated_ir_filepath = os.path.join(epycc_dirpath, "generated", "irs.ll")
+
+            lines = generate_c_snippets()
+            shipped_lines = []
+            if (os.path.exists(generated_c_filepath)):
+                with open(generated_c_filepath, "r") as f:
+                    shipped_lines = f.readlines()
+        
+            if ((not os.path.exists(generated_ir_filepath)) or 
+                (get_c_snippets_hash(lines) != get_c_snippets_hash(shipped_lines))):
+                precompile_c_snippets(generated_c_filepath, generated_ir_filepath, lines)
 
-    invoke_clang(generated_c_filepath, generated_ir_filepath)
+            c_snippets_ir = load_functions_ir(generated_ir_filepath)
+            c_snippets_ir.update(parse_functions_ir(arena_runtime_ir.splitlines()))
+
+    return c_snippets_ir
     
 
 def convert_to_clang_irs(llvm_irs):
@@ -826,6 +1048,16 @@ def generate_ir(generator, node):
 
         return tokens
 
+    def get_node_line(node):
+        # Return the C line of the first token in the node, None if the node
+        # has no tokens
+        while (isinstance(node, lark.Tree)):
+            if (len(node.children) == 0):
+                return None
+            node = node.children[0]
+
+        return node.line
+
     def is_integer_type(a_type):
         return (a_type in integer_types)
 
@@ -1024,6 +1256,8 @@ def generate_ir(generator, node):
                     # Structs (note structs are always compile-time size, by C99
                     # spec they can't contain runtime sized arrays)
                     type_is_struct_or_union(a_type) or
+                    # Strided array parameters, stored as the base pointer
+                    type_is_strided_array(a_type) or
                     # Compile-time sized arrays, top level open containing
                     # compile-time sized arrays, or single-level open array
                     (
@@ -1067,32 +1301,34 @@ def generate_ir(generator, node):
                     #   because clang will route early returns to a common 
                     #   exit point)
 
-                    if (generator.llvmir.stack_ir_reg is None):
-                        # There hasn't been any stack saving in this scope, save it
-                        stack_ir_reg = generate_save_stack_ir(generator)
-
-                        # Stash it away so scope closing, opening, continue and
-                        # break can snoop it
-                        generator.llvmir.stack_ir_reg = stack_ir_reg
-
-                    # Multiply all dimensions to get the total size
-                    a_type, dim = sym.value_type
-                    size_ir_reg = dim.ir_reg
-                    # XXX This should use something more abstract like size_t
-                    size_t_type = "unsigned long long"
-                    size_ir_reg = generate_type_conversion_ir(generator, dim, size_t_type)
-                    while (type_is_array(a_type)):
-                        a_type, dim = a_type
-                        dim_ir_reg = generate_type_conversion_ir(generator, dim, size_t_type)
-                        size_ir_reg = generator.llvmir.builder.mul(size_ir_reg, dim_ir_reg)
-                    
-                    # Allocate the runtime sized array in the current block
-                    # position 
-                    # Note we have to allocate for the item type (eg int), not
-                    # for the array type (eg int**)
-                    sym.ir_ref = generator.llvmir.builder.alloca(get_llvmlite_type(a_type), size_ir_reg)
-                    # XXX Setting align = 16 to match clang, revisit
-                    sym.ir_ref.align = 16
+                    loop = None
+                    if (generator.hoist_vlas):
+                        loop = get_vla_hoisting_loop(sym)
+
+                    if (loop is not None):
+                        # Loop invariant size, allocate once before the loop
+                        # instead of on every iteration
+                        sym.ir_ref = generate_hoisted_vla_ir(generator, sym, loop)
+
+                    else:
+                        if (generator.llvmir.stack_ir_reg is None):
+                            # There hasn't been any stack saving in this scope, save it
+                            # Stash it away so scope closing, opening, continue and
+                            # break can snoop it
+                            (generator.llvmir.stack_ir_reg, 
+                             generator.llvmir.arena_mark_ir_reg) = generate_save_stack_ir(generator)
+
+                        # Multiply all dimensions to get the total size
+                        size_ir_reg = generate_vla_size_ir(generator, 
+                            get_array_dims(sym.value_type))
+                        
+                        # Allocate the runtime sized array in the current block
+                        # position 
+                        # Note we have to allocate for the item type (eg int), not
+                        # for the array type (eg int**)
+                        sym.ir_ref = generate_vla_alloc_ir(generator, 
+                            get_array_item_type(sym.value_type), size_ir_reg)
+
                     # Return the full type since the dimensions ir will be
                     # needed for working out the indexing
                     a_type = sym.value_type
@@ -1156,9 +1392,21 @@ def generate_ir(generator, node):
         )
 
         # Create the function in the IR builder
+        parameter_llvmlite_types = []
+        for parameter in parameters:
+            parameter_llvmlite_types.append(get_llvmlite_type(parameter.value_type))
+            if (type_is_strided_array(parameter.value_type)):
+                # Strided arrays take the byte stride of each dimension as
+                # hidden parameters after the base pointer
+                parameter_llvmlite_types.extend(
+                    [ir.IntType(64)] * len(get_array_dims(parameter.value_type)))
+        if (generator.arena):
+            # Functions take the arena as hidden last parameter, see
+            # generate_arena_alloc_ir
+            parameter_llvmlite_types.append(ir.IntType(8).as_pointer())
         fn_llvmlite_type = ir.FunctionType(
             get_llvmlite_type(function_type), 
-            [get_llvmlite_type(parameter.value_type) for parameter in parameters]
+            parameter_llvmlite_types
         )
         
         fn.ir = ir.Function(generator.llvmir.module, fn_llvmlite_type, name=function_name)
@@ -1262,6 +1510,18 @@ def generate_ir(generator, node):
 
         arg_ir_regs = []
         for (arg_ir_ref, arg_ir_reg, arg_type), parameter in zip(arg_ir_ref_reg_types, fn.parameters):
+            if (type_is_strided_array(parameter.value_type)):
+                # Pass the base pointer and the strides of the argument
+                # XXX Missing passing contiguous arrays by working out their
+                #     strides
+                assert (type_is_strided_array(arg_type) and 
+                    (len(get_array_dims(arg_type)) == len(get_array_dims(parameter.value_type))) and
+                    (get_array_item_type(arg_type) == get_array_item_type(parameter.value_type))), \
+                    "Strided array parameters only take strided arrays of the same type"
+                arg_ir_regs.append(arg_ir_reg)
+                arg_ir_regs.extend([dim.ir_reg for dim in get_array_dims(arg_type)])
+                continue
+
             # Convert each argument to the parameter type
             
             # XXX Converting the type to str easily deals with comparing complex
@@ -1288,6 +1548,10 @@ def generate_ir(generator, node):
                 )
             
             arg_ir_regs.append(arg_ir_reg)
+
+        if (generator.arena):
+            # Callees allocate from the caller's arena
+            arg_ir_regs.append(generator.llvmir.function.args[-1])
         
         res_type = fn.value_type
         res_ir_reg = generator.llvmir.builder.call(fn.ir, arg_ir_regs)
@@ -1305,22 +1569,370 @@ def generate_ir(generator, node):
         return a_ir_reg
 
     def generate_save_stack_ir(generator):
+        """
+        Save the stack and, if using arenas, the arena mark so the runtime
+        sized arrays allocated afterwards can be released, see
+        generate_restore_stack_ir
+
+        Returns the stack register and the arena mark register (None if not
+        using arenas)
+        """
         # XXX A lot of this could be cached
         pint8 = ir.IntType(8).as_pointer()
         stacksave_ir_type = ir.FunctionType(pint8, [])
         stacksave_fn_ir = generator.llvmir.module.declare_intrinsic("llvm.stacksave", fnty=stacksave_ir_type) 
         stack_ir_reg = generator.llvmir.builder.call(stacksave_fn_ir, []) 
 
-        return stack_ir_reg
+        arena_mark_ir_reg = None
+        if (generator.arena):
+            arena_mark_ir_reg = generate_extern_call_ir(
+                generator, "epycc_arena_mark", "unsigned long long", 
+                [["char", None], generator.llvmir.function.args[-1]])
+
+        return stack_ir_reg, arena_mark_ir_reg
+
+    def generate_restore_stack_ir(generator, stack_ir_reg = None, arena_mark_ir_reg = None):
+        """
+        Restore the given stack and arena mark registers, or the current
+        scope's if None
+        """
+        if (stack_ir_reg is None):
+            stack_ir_reg = generator.llvmir.stack_ir_reg
+            arena_mark_ir_reg = generator.llvmir.arena_mark_ir_reg
 
-    def generate_restore_stack_ir(generator):
         # XXX A lot of this could be cached
-        if (generator.llvmir.stack_ir_reg is not None):
+        if (stack_ir_reg is not None):
             pint8 = ir.IntType(8).as_pointer()
             stackrestore_ir_type = ir.FunctionType(ir.VoidType(), [pint8])
             stackrestore_fn_ir = generator.llvmir.module.declare_intrinsic("llvm.stackrestore", fnty=stackrestore_ir_type)
-            generator.llvmir.builder.call(stackrestore_fn_ir, [generator.llvmir.stack_ir_reg])
+            generator.llvmir.builder.call(stackrestore_fn_ir, [stack_ir_reg])
+
+        if (arena_mark_ir_reg is not None):
+            generate_extern_call_ir(generator, "epycc_arena_release", "void", 
+                [["char", None], generator.llvmir.function.args[-1], 
+                 "unsigned long long", arena_mark_ir_reg])
+
+    def generate_vla_size_ir(generator, dims):
+        """
+        Return the register with the number of items of a runtime sized array
+        with the given dimensions
+        """
+        # XXX This should use something more abstract like size_t
+        size_t_type = "unsigned long long"
+        size_ir_reg = None
+        for dim in dims:
+            dim_ir_reg = generate_type_conversion_ir(generator, dim, size_t_type)
+            if (size_ir_reg is None):
+                size_ir_reg = dim_ir_reg
+            else:
+                size_ir_reg = generator.llvmir.builder.mul(size_ir_reg, dim_ir_reg)
+
+        return size_ir_reg
+
+    def generate_vla_alloc_ir(generator, item_type, count_ir_reg):
+        if (generator.arena):
+            ptr_ir_reg = generate_arena_alloc_ir(generator, item_type, count_ir_reg)
+
+        else:
+            ptr_ir_reg = generator.llvmir.builder.alloca(get_llvmlite_type(item_type), count_ir_reg)
+            # XXX Setting align = 16 to match clang, revisit
+            ptr_ir_reg.align = 16
+
+        return ptr_ir_reg
+
+    def get_identifier_names(node):
+        names = set()
+        if (isinstance(node, lark.Tree)):
+            if (node.data == "identifier"):
+                names.add(node.children[0].value)
+            else:
+                for child in node.children:
+                    names |= get_identifier_names(child)
+
+        return names
+
+    def get_modified_names(node):
+        """
+        Return the names of the variables that may be modified by the node,
+        conservatively every identifier in the target of assignments and
+        increments
+        """
+        names = set()
+        if (isinstance(node, lark.Tree)):
+            if ((node.data == "assignment_expression") and (len(node.children) == 3)):
+                names |= get_identifier_names(node.children[0])
+
+            elif ((node.data == "postfix_expression") and (node.children[-1] in ["++", "--"])):
+                names |= get_identifier_names(node.children[0])
+
+            elif ((node.data == "unary_expression") and (node.children[0] in ["++", "--"])):
+                names |= get_identifier_names(node.children[1])
+
+            for child in node.children:
+                names |= get_modified_names(child)
+
+        return names
+
+    def has_side_effects(node):
+        """
+        Return True if evaluating the expression node may have side effects,
+        conservatively any call, assignment or increment
+        """
+        if (not isinstance(node, lark.Tree)):
+            return False
+
+        if ((node.data == "assignment_expression") and (len(node.children) == 3)):
+            return True
+
+        if ((node.data == "postfix_expression") and 
+            any([(child in ["(", "++", "--"]) for child in node.children])):
+            return True
+
+        if ((node.data == "unary_expression") and (node.children[0] in ["++", "--"])):
+            return True
+
+        return any([has_side_effects(child) for child in node.children])
+
+    def is_loop_invariant(node, loop):
+        """
+        Return True if the expression node is known to have the same value in
+        every iteration of the loop: only constants and scalar variables
+        declared outside the loop and not modified inside the loop, and no
+        calls, array or member accesses, assignments or increments
+        """
+        if (not isinstance(node, lark.Tree)):
+            return True
+
+        if (node.data == "identifier"):
+            name = node.children[0].value
+            sym = generator.symbol_table.get(name, None)
+            if (loop.modified_names is None):
+                loop.modified_names = get_modified_names(loop.node)
 
+            return ((sym is not None) and (sym.type in ["variable", "parameter"]) and 
+                type_is_scalar(sym.value_type) and 
+                (generator.symbol_table.get_depth(name) <= loop.depth) and
+                (name not in loop.modified_names))
+
+        if ((node.data in ["postfix_expression", "assignment_expression"]) and (len(node.children) > 1)):
+            return False
+
+        if ((node.data == "unary_expression") and 
+            ((node.children[0] in ["++", "--"]) or 
+             (isinstance(node.children[0], lark.Tree) and 
+              (node.children[0].children[0] in ["&", "*"])))):
+            return False
+
+        return all([is_loop_invariant(child, loop) for child in node.children])
+
+    def get_vla_hoisting_loop(sym):
+        """
+        Return the innermost loop if the runtime sized array sym is declared
+        directly in its body and its dimensions are invariant in it, None
+        otherwise
+        """
+        if ((sym.dim_nodes is None) or (len(generator.llvmir.loops) == 0)):
+            return None
+
+        loop = generator.llvmir.loops[-1]
+        # Only arrays declared directly in the loop body, arrays declared
+        # outside the loop but first used inside need to outlive the loop and
+        # arrays declared in nested blocks, conditionals or inner loops or
+        # after a jump or conditional in the body may never be reached, so
+        # their size is not safe to evaluate and allocate up front
+        if ((generator.symbol_table.get_depth(sym.name) != loop.body_depth) or loop.branched):
+            return None
+
+        # The loop condition is evaluated again in the preheader to skip the
+        # allocation when the loop doesn't run, see generate_hoisted_vla_ir
+        if ((loop.cond_node is not None) and has_side_effects(loop.cond_node)):
+            return None
+
+        if (not all([is_loop_invariant(dim_node, loop) for dim_node in sym.dim_nodes])):
+            return None
+
+        return loop
+
+    def generate_hoisted_vla_ir(generator, sym, loop):
+        """
+        Allocate the runtime sized array sym at the end of the loop preheader,
+        the allocation is released when the loop finishes, see
+        generate_loop_exit_ir
+        """
+        builder = generator.llvmir.builder
+        block = builder.block
+        
+        # Remove the preheader branch into the loop since allocating may need
+        # new blocks, put it back at the end
+        builder.position_at_end(loop.preheader)
+        builder.remove(loop.preheader.terminator)
+
+        if (loop.stack_ir_reg is None):
+            loop.stack_ir_reg, loop.arena_mark_ir_reg = generate_save_stack_ir(generator)
+
+        # Regenerate the dimensions in the preheader, they are invariant so
+        # they evaluate to the same value as in the declaration
+        dims = [generate_ir(generator, dim_node) for dim_node in sym.dim_nodes]
+        size_ir_reg = generate_vla_size_ir(generator, dims)
+
+        if (loop.cond_node is not None):
+            # Only allocate if the loop runs at least once, the original
+            # program never evaluates the size otherwise, which may be
+            # negative or too big to allocate
+            gen_node = generate_ir(generator, loop.cond_node)
+            # Convert expression to _Bool
+            cond_ir_reg, cond_type = get_ir_reg_and_type(gen_node)
+            res_type = "_Bool"
+            if (cond_type != res_type):
+                cond_ir_reg = generate_extern_call_ir(generator, 
+                    get_fn_name("cnv", res_type, cond_type), res_type, [cond_type, cond_ir_reg])
+
+            guard_bb = builder.block
+            alloc_bb = builder.function.append_basic_block("vlaalloc")
+            alloc_end_bb = builder.function.append_basic_block("vlaallocend")
+            generate_cbranch_ir(cond_ir_reg, alloc_bb, alloc_end_bb)
+            builder.position_at_start(alloc_bb)
+
+        ptr_ir_reg = generate_vla_alloc_ir(generator, get_array_item_type(sym.value_type), 
+            size_ir_reg)
+
+        if (loop.cond_node is not None):
+            # Allocating may have created blocks, branch from the last one
+            alloc_bb = builder.block
+            generate_branch_ir(alloc_end_bb)
+            builder.position_at_start(alloc_end_bb)
+            alloc_ptr_ir_reg = ptr_ir_reg
+            ptr_ir_reg = builder.phi(alloc_ptr_ir_reg.type)
+            ptr_ir_reg.add_incoming(alloc_ptr_ir_reg, alloc_bb)
+            ptr_ir_reg.add_incoming(ir.Constant(alloc_ptr_ir_reg.type, None), guard_bb)
+
+        generate_branch_ir(loop.entry_bb)
+        # Allocations may have created blocks, hoist any further allocations
+        # to the new end of the preheader
+        loop.preheader = builder.block
+
+        builder.position_at_end(block)
+
+        return ptr_ir_reg
+
+    def generate_loop_enter_ir(generator, node, entry_bb, depth, cond_node):
+        """
+        Branch into the loop and track it for hoisting runtime sized arrays,
+        must be called in the loop preheader. Symbols with depth or lower
+        depth are declared outside the loop. cond_node is the condition
+        checked before the first iteration, None if the first iteration
+        always runs
+        """
+        generator.llvmir.loops.append(Struct(
+            node = node,
+            preheader = generator.llvmir.builder.block,
+            entry_bb = entry_bb,
+            depth = depth,
+            # The loop body statement is a compound statement that pushes its
+            # own scope
+            body_depth = len(generator.symbol_table) + 1,
+            cond_node = cond_node,
+            branched = False,
+            modified_names = None,
+            stack_ir_reg = None, 
+            arena_mark_ir_reg = None,
+        ))
+        generate_branch_ir(entry_bb)
+
+    def mark_loops_branched(generator):
+        """
+        Flag the loops being generated as having a jump or conditional, the
+        code after it in the loop bodies may not be reached in every
+        iteration, see get_vla_hoisting_loop
+        """
+        for loop in generator.llvmir.loops:
+            loop.branched = True
+
+    def generate_loop_exit_ir(generator):
+        """
+        Release the runtime sized arrays hoisted to the preheader, must be
+        called at the start of the loop's exit block
+        """
+        loop = generator.llvmir.loops.pop()
+        generate_restore_stack_ir(generator, loop.stack_ir_reg, loop.arena_mark_ir_reg)
+
+    def generate_arena_alloc_ir(generator, item_type, count_ir_reg):
+        """
+        Allocate count_ir_reg items of item_type from the arena passed in the
+        function's hidden last parameter, falling back to the stack if there's
+        no arena, the arena is exhausted or the allocation is smaller than the
+        arena threshold.
+
+        Returns the pointer to the first item
+        """
+        # Allocations of scopes exited via return are released by
+        # generate_arena_return_release_ir
+        generator.llvmir.arena_allocated = True
+        builder = generator.llvmir.builder
+        item_ptr_type = get_llvmlite_type(item_type).as_pointer()
+        # Get the size of the item type as the address of item 1 of a null
+        # pointer, this gets constant folded
+        item_size_ir_reg = builder.ptrtoint(
+            builder.gep(ir.Constant(item_ptr_type, None), [ir.IntType(32)(1)]), 
+            ir.IntType(64))
+        size_ir_reg = builder.mul(count_ir_reg, item_size_ir_reg)
+
+        stack_block = builder.function.append_basic_block("arenafallback")
+        end_block = builder.function.append_basic_block("arenaend")
+        
+        if (generator.arena_threshold > 0):
+            # Arrays smaller than the threshold go in the stack
+            arena_block = builder.function.append_basic_block("arenaalloc")
+            is_small_ir_reg = builder.icmp_unsigned("<", size_ir_reg, 
+                ir.IntType(64)(generator.arena_threshold))
+            generate_cbranch_ir(is_small_ir_reg, stack_block, arena_block)
+            builder.position_at_end(arena_block)
+
+        arena_ptr_ir_reg = generate_extern_call_ir(generator, "epycc_arena_alloc", 
+            ["char", None], 
+            [["char", None], generator.llvmir.function.args[-1], 
+             "unsigned long long", size_ir_reg])
+        
+        arena_block = builder.block
+        is_null_ir_reg = builder.icmp_unsigned("==", arena_ptr_ir_reg, 
+            ir.Constant(arena_ptr_ir_reg.type, None))
+        generate_cbranch_ir(is_null_ir_reg, stack_block, end_block)
+
+        builder.position_at_end(stack_block)
+        stack_ptr_ir_reg = builder.alloca(ir.IntType(8), size_ir_reg)
+        # XXX Setting align = 16 to match clang, revisit
+        stack_ptr_ir_reg.align = 16
+        generate_branch_ir(end_block)
+
+        builder.position_at_end(end_block)
+        ptr_ir_reg = builder.phi(arena_ptr_ir_reg.type)
+        ptr_ir_reg.add_incoming(arena_ptr_ir_reg, arena_block)
+        ptr_ir_reg.add_incoming(stack_ptr_ir_reg, stack_block)
+
+        return builder.bitcast(ptr_ir_reg, item_ptr_type)
+
+
+    def generate_arena_return_release_ir(generator):
+        """
+        Release the arena allocations of the current function before each of
+        its returns.
+
+        Returns exit the enclosing scopes without running their releases (see
+        generate_restore_stack_ir), releasing to the arena mark taken at
+        function entry frees the allocations of all the enclosing scopes and
+        hoisted loops at once
+        """
+        builder = generator.llvmir.builder
+        function = generator.llvmir.function
+        builder.position_at_start(function.blocks[0])
+        entry_mark_ir_reg = generate_extern_call_ir(generator, "epycc_arena_mark", 
+            "unsigned long long", [["char", None], function.args[-1]])
+        for block in function.blocks:
+            if ((block.terminator is not None) and (block.terminator.opname == "ret")):
+                builder.position_before(block.terminator)
+                generate_extern_call_ir(generator, "epycc_arena_release", "void", 
+                    [["char", None], function.args[-1], 
+                     "unsigned long long", entry_mark_ir_reg])
 
     def generate_assign_ir(generator, a, b):
         a_ir_ref, a_ir_reg, a_type = get_ir_ref_reg_and_type(a)
@@ -1403,6 +2015,12 @@ def generate_ir(generator, node):
     if (type(node) is lark.Tree):
         if (debug):
             print "  " * generator.depth, "enter", node.data
+        if (generator.instrument and (generator.llvmir.function is not None)):
+            # Map each basic block to the C line of the first node generated
+            # into it, used to map the block counters back to lines
+            block = generator.llvmir.builder.block
+            if (block not in generator.llvmir.block_lines):
+                generator.llvmir.block_lines[block] = get_node_line(node)
         # XXX When there's more than one child we need to special case some
         #     of the rules so we avoid returning too much nesting or long
         #     lists that make things down the line  harder or
@@ -1417,7 +2035,9 @@ def generate_ir(generator, node):
             generator.symbol_table.push_scope()
 
             stack_ir_reg = generator.llvmir.stack_ir_reg
+            arena_mark_ir_reg = generator.llvmir.arena_mark_ir_reg
             generator.llvmir.stack_ir_reg = None
+            generator.llvmir.arena_mark_ir_reg = None
     
             gen_node = generate_ir(generator, node.children[1])
 
@@ -1428,6 +2048,7 @@ def generate_ir(generator, node):
                 
             # Put back whatever stack register the parent block stashed or not
             generator.llvmir.stack_ir_reg = stack_ir_reg
+            generator.llvmir.arena_mark_ir_reg = arena_mark_ir_reg
             
             generator.symbol_table.pop_scope()
 
@@ -1482,12 +2103,6 @@ def generate_ir(generator, node):
                 gen_node = Struct(type="ir", value_type=res_type, ir_reg=res_ir_reg)
 
             elif (node.children[1] == "["):
-                def get_array_item_type(t):
-                    if (isinstance(t[0], list)):
-                        res = get_array_item_type(t[0])
-                    else:
-                        res = t[0]
-
                 # |  postfix_expression "[" expression "]"
                 gen_node = generate_ir(generator, node.children[0])
                 assert(isinstance(gen_node, Struct))
@@ -1538,7 +2153,25 @@ def generate_ir(generator, node):
 
                 # XXX The gep's below are setting inbounds=True to match clang,
                 #     revisit
-                if (type_is_compile_time_sized_array(a_type)):
+                if (type_is_strided_array(a_type)):
+                    # Strided array, offset the byte pointer by the index times
+                    # the byte stride of the dimension
+                    #
+                    #   float f(float b[*][*]) { return b[2][1]; }
+                    #
+                    #   %5 = mul i64 2, %b_stride0
+                    #   %6 = getelementptr inbounds i8, i8* %b, i64 %5
+                    #   %7 = mul i64 1, %b_stride1
+                    #   %8 = getelementptr inbounds i8, i8* %6, i64 %7
+                    #   %9 = bitcast i8* %8 to float*
+                    ind_ir_reg = generator.llvmir.builder.mul(ind_ir_reg, a_type[1].ir_reg)
+                    ptr = generator.llvmir.builder.gep(ir_reg, [ind_ir_reg], True)
+                    if (not type_is_array(a_type[0])):
+                        # Last dimension, point to the item
+                        ptr = generator.llvmir.builder.bitcast(ptr, 
+                            get_llvmlite_type(a_type[0]).as_pointer())
+
+                elif (type_is_compile_time_sized_array(a_type)):
                     # Dimensions are known at compile time, let getelementptr
                     # work out the address calculation
     
@@ -1583,7 +2216,13 @@ def generate_ir(generator, node):
                 #     generated for partial indexing which is thrown away, can
                 #     it be delayed? (not a big deal since the optimizer removes
                 #     it anyway)
-                ir_reg = generator.llvmir.builder.load(ptr)
+                if (type_is_strided_array(a_type) and type_is_array(a_type[0])):
+                    # Partially indexed strided array, the byte pointer is the
+                    # base of the remaining dimensions
+                    ir_reg = ptr
+
+                else:
+                    ir_reg = generator.llvmir.builder.load(ptr)
                 # Lower the C type by removing the last dimension
                 gen_node = Struct(type="ir", value_type=a_type[0], ir_reg=ir_reg, ir_ref=ptr)
 
@@ -1727,10 +2366,13 @@ def generate_ir(generator, node):
             #     |  "continue" ";"
             #     |  "break" ";"
             #     |  "return" expression? ";"
+            mark_loops_branched(generator)
             if (node.children[0].value == "return"):
                 # Note there's no need to restore the stack register on return
                 # since there could be multiple of them stacked and the stack
-                # is cleaned up by return anyway
+                # is cleaned up by return anyway. Arena allocations are
+                # released once the function is generated, see
+                # generate_arena_return_release_ir
                 # XXX This causes a mismatch wrt to clang which does seems to
                 #     have a single return point and does cleanup. Maybe look
                 #     into doing that too?
@@ -1838,18 +2480,32 @@ def generate_ir(generator, node):
                 # declaration and they may not have names
                 fn.parameters = parameters
 
+            # C prototype used to declare the function in sources linking
+            # this library, see epycc_compile(..., libs=...)
+            fn.prototype = string.join(get_tree_tokens(node.children[0]) + 
+                get_tree_tokens(node.children[1]), " ") + ";"
+
             # Link the parameters to the ir builder function arguments and put
             # them in the overflow symbol table
-            for parameter, arg in zip(fn.parameters, fn.ir.args):
-                parameter.ir_reg = arg
+            args = iter(fn.ir.args)
+            for parameter in fn.parameters:
+                parameter.ir_reg = next(args)
+                if (type_is_strided_array(parameter.value_type)):
+                    # Strided arrays are followed by the stride of each
+                    # dimension
+                    for i, dim in enumerate(get_array_dims(parameter.value_type)):
+                        dim.ir_reg = next(args)
+                        dim.ir_reg.name = "%s_stride%d" % (parameter.name, i)
                 generator.symbol_table.set_overflow_item(parameter.name, parameter)
 
             generator.llvmir.function = fn.ir
+            generator.llvmir.arena_allocated = False
 
             # Give a hard-coded name that gets removed below since clang-generated
             # tests don't contain a basic block entry label
             block = generator.llvmir.function.append_basic_block("entry")
             generator.llvmir.builder = ir.IRBuilder(block)
+            generator.llvmir.block_lines = { block : get_node_line(node) }
 
             # Generate the function's body
             gen_node = generate_ir(generator, node.children[-1])
@@ -1867,7 +2523,15 @@ def generate_ir(generator, node):
                 generator.llvmir.builder.ret_void()
             else:
                 generator.llvmir.builder.ret(get_llvmlite_type(fn.value_type)(ir.Undefined))
+
+            if (generator.llvmir.arena_allocated):
+                generate_arena_return_release_ir(generator)
             
+            # Stash the block line information, the counters are inserted once
+            # all the functions are generated and the number of counters is
+            # known, see generate_counters_ir
+            fn.block_lines = generator.llvmir.block_lines
+
             fn.llvm_irs = str(generator.llvmir.function).splitlines()
             do_reindexing = False
             if (do_reindexing):
@@ -1918,7 +2582,17 @@ def generate_ir(generator, node):
                     isinstance(gen_node[1], Struct) and gen_node[1].type == "identifier"))
 
                 identifier = gen_node[1]
-                if (identifier.dims is not None):
+                if ((identifier.dims is not None) and 
+                    any([(dim is not None) and (dim.type == "strided") for dim in identifier.dims])):
+                    # Strided array, keep all the dimensions since each one
+                    # needs its stride, see type_is_strided_array
+                    # XXX Missing mixing strided and non strided dimensions
+                    assert all([(dim is not None) and (dim.type == "strided") for dim in identifier.dims]), \
+                        "All the dimensions of strided arrays must be [*]"
+                    for dim in reversed(identifier.dims):
+                        parameter_type = [parameter_type, dim]
+
+                elif (identifier.dims is not None):
                     # Array, build the type
                     parameter_type = build_type_from_dimensions(parameter_type, identifier.dims)
                     # Array parameters are passed by reference, convert the last 
@@ -2008,6 +2682,10 @@ def generate_ir(generator, node):
                         name=identifier.value, 
                         value_type=decl_type,
                         # Value_reg and value_ref will be assigned on usage
+                        # The dimension expressions are kept around to
+                        # regenerate them when hoisting runtime sized arrays
+                        # out of loops, see generate_hoisted_vla_ir
+                        dim_nodes=getattr(identifier, "dim_nodes", None),
                     )
                     generator.symbol_table[identifier.value] = variable
                     
@@ -2149,6 +2827,12 @@ def generate_ir(generator, node):
                     # Unsized array, return None dimensions
                     dim = None
 
+                elif (node.children[-2] == "*"):
+                    # Array of unspecified size, only valid in parameters where
+                    # it declares a strided array, the stride ir_reg is set
+                    # when the function is defined, see type_is_strided_array
+                    dim = Struct(type="strided", ir_reg=None)
+
                 else:
                     # XXX No support for qualified arrays yet
                     assert (node.children[-2].data == "assignment_expression")
@@ -2160,8 +2844,10 @@ def generate_ir(generator, node):
                     
                 if (gen_node.dims is None):
                     gen_node.dims = [dim]
+                    gen_node.dim_nodes = [node.children[-2]]
                 else:
                     gen_node.dims.append(dim)
+                    gen_node.dim_nodes.append(node.children[-2])
                     
             else:
                 assert False, "Unhandled direct_declarator"
@@ -2217,14 +2903,59 @@ def generate_ir(generator, node):
 
             gen_node = Struct(type="constant", value_type = float_type, value= value)
 
-        elif ((node.data == "character_constant") or (node.data == "string_literal")):
-            # XXX Needs handling of the escape cases, encodings, etc
-            #     octal-escape-sequence
-            #     hexadecimal-escape-sequence
-            #     universal-character-name
-            # simple_escape_sequence: "\\'" | "\\\"" | "\\?" | "\\" | "\\a" | "\\b" | "\\f" | "\\n" | "\\r" | "\\t" | "\\v"
+        elif (node.data == "character_constant"):
+            # Character constants are int, see C99 6.4.4.4
+            value = node.children[0].value
+            if (value.startswith("L")):
+                # Wide character, wchar_t is int
+                value = decode_c_escapes(value[2:-1], True)[0]
+                if (value >= 0x80000000):
+                    value -= 0x100000000
 
-            assert False, "character_constant / string_literal not supported yet!"
+            else:
+                chars = decode_c_escapes(value[1:-1])
+                if (len(chars) == 1):
+                    # char is signed, so are the character constants
+                    value = ord(chars)
+                    if (value >= 0x80):
+                        value -= 0x100
+                else:
+                    # Multi-character constants are implementation defined,
+                    # do the same as gcc and clang
+                    value = 0
+                    for c in chars:
+                        value = ((value << 8) | ord(c)) & 0xffffffff
+                    if (value >= 0x80000000):
+                        value -= 0x100000000
+
+            gen_node = Struct(type="constant", value_type="int", value=value)
+
+        elif (node.data == "string_literal"):
+            # String literals are private constant globals, identical literals
+            # share the global
+            value = node.children[0].value
+            assert not value.startswith("L"), "Wide string literals not supported yet!"
+            data = decode_c_escapes(value[1:-1]) + "\0"
+
+            global_ir = generator.llvmir.string_literals.get(data, None)
+            if (global_ir is None):
+                global_ir_type = ir.ArrayType(ir.IntType(8), len(data))
+                global_ir = ir.GlobalVariable(generator.llvmir.module, global_ir_type, 
+                    generator.llvmir.module.get_unique_name(".str"))
+                global_ir.linkage = "private"
+                global_ir.global_constant = True
+                global_ir.unnamed_addr = True
+                global_ir.align = 1
+                global_ir.initializer = ir.Constant(global_ir_type, bytearray(data))
+                generator.llvmir.string_literals[data] = global_ir
+
+            # Type it as a compile-time sized char array, same as a local
+            # char array variable. Uses go through the global (eg array
+            # parameters and subscripts), don't load the whole array, the
+            # register is a constant GEP to the first char like clang's
+            dim = Struct(type="ir", value_type="int", ir_reg=ir.IntType(32)(len(data)))
+            gen_node = Struct(type="ir", value_type=["char", dim], 
+                ir_reg=global_ir.gep([ir.IntType(64)(0), ir.IntType(64)(0)]), ir_ref=global_ir)
 
 
         elif (node.data == "identifier"):
@@ -2306,7 +3037,8 @@ def generate_ir(generator, node):
                 generator.llvmir.continue_bb = loop_cond_bb
 
                 # Jump to the condition
-                generate_branch_ir(loop_cond_bb)
+                generate_loop_enter_ir(generator, node, loop_cond_bb, 
+                    len(generator.symbol_table), node.children[2])
                 
                 # Generate loop condition
                 generator.llvmir.builder.position_at_start(loop_cond_bb)
@@ -2332,6 +3064,7 @@ def generate_ir(generator, node):
 
                 # Generate the end
                 generator.llvmir.builder.position_at_start(loop_end_bb)
+                generate_loop_exit_ir(generator)
 
             elif (node.children[0] == "do"):
                 # |  "do" statement "while" "(" expression ")" ";"
@@ -2348,7 +3081,8 @@ def generate_ir(generator, node):
                 generator.llvmir.continue_bb = loop_cond_bb
 
                 # Jump to the loop body
-                generate_branch_ir(loop_body_bb)
+                generate_loop_enter_ir(generator, node, loop_body_bb, 
+                    len(generator.symbol_table), None)
 
                 # Generate loop body
                 generator.llvmir.builder.position_at_start(loop_body_bb)
@@ -2374,6 +3108,7 @@ def generate_ir(generator, node):
 
                 # Generate the end
                 generator.llvmir.builder.position_at_start(loop_end_bb)
+                generate_loop_exit_ir(generator)
 
             elif (node.children[0] == "for"):
                 # |  "for" "(" expression? ";" expression? ";" expression? ")" statement
@@ -2415,7 +3150,13 @@ def generate_ir(generator, node):
                 generator.llvmir.break_bb = loop_end_bb
                 generator.llvmir.continue_bb = loop_incr_bb
 
-                generate_branch_ir(loop_cond_bb)
+                # The declaration is evaluated before the loop, take the loop
+                # depth at the declaration scope
+                cond_node = None
+                if (node.children[next_child] != ";"):
+                    cond_node = node.children[next_child]
+                generate_loop_enter_ir(generator, node, loop_cond_bb, 
+                    len(generator.symbol_table) - 1, cond_node)
                 
                 generator.llvmir.builder.position_at_start(loop_cond_bb)
                 if (node.children[next_child] != ";"):
@@ -2459,6 +3200,7 @@ def generate_ir(generator, node):
                 
                 # Generate the end
                 generator.llvmir.builder.position_at_start(loop_end_bb)
+                generate_loop_exit_ir(generator)
 
                 # Restore old break/continue
                 generator.llvmir.break_bb = prev_break_bb
@@ -2476,6 +3218,7 @@ def generate_ir(generator, node):
             # selection_statement:  "if" "(" expression ")" statement
             # |  "if" "(" expression ")" statement "else" statement
             # |  "switch" "(" expression ")" statement
+            mark_loops_branched(generator)
             if (node.children[0] == "if"):
                 # Generate the condition expression
                 gen_node = generate_ir(generator, node.children[2])
@@ -2541,68 +3284,716 @@ def generate_ir(generator, node):
     return gen_node
 
 
-llvm_initialized = False
+def generate_counters_ir(generator):
+    """
+    Insert one execution counter per basic block of every function defined in
+    the module (the entry block counter is the function call counter).
 
-def llvm_compile(llvm_ir, function_signatures):
-    global llvm_initialized
-    if (not llvm_initialized):
-        # This switches the assembler emit from at&t to intel, needs to be done
-        # before initializing llvmlite, otherwise it's ignored
-        # Will also give a warning
-        #       "for the -x86-asm-syntax option: may only occur zero or one times!"
-        # when llvm_compile is initialized more than once (but other than that
-        # multiple initialization doesn't seem to be a problem)
-    
-        # XXX This probably doesn't affect the input assembler, only the output, which
-        #     has to be done in AT&T eg
-        #       call void asm sideeffect "movl %eax, %eax", "~{dirflag},~{fpsr},~{flags}"() #2
+    The counters live in a single global i64 array named __epycc_counters and
+    are incremented with monotonic atomic adds so they are safe to use when
+    calling the functions from multiple threads without serializing the
+    callers.
+
+    This needs to be done once all the functions have been generated since
+    the size of the global array is not known before.
+
+    Returns the list of counters as Struct(index, function, block, line, kind)
+    """
+    functions = [sym for sym in generator.symbol_table.values()
+        if ((sym.type == "function") and hasattr(sym, "llvm_irs"))]
+
+    counters = []
+    for fn in functions:
+        fn.counters = []
+        for block in fn.ir.blocks:
+            # Don't waste counters in the blocks placed after returns,
+            # breaks, etc
+            if (block.name.startswith("notreached")):
+                continue
+            is_entry = (len(fn.counters) == 0)
+            counter = Struct(
+                index = len(counters),
+                function = fn.name,
+                block = block.name,
+                line = fn.block_lines.get(block, None),
+                kind = "function" if is_entry else "block",
+            )
+            fn.counters.append(counter)
+            counters.append(counter)
+
+    if (len(counters) == 0):
+        return counters
+
+    counters_type = ir.ArrayType(ir.IntType(64), len(counters))
+    counters_ir = ir.GlobalVariable(generator.llvmir.module, counters_type, "__epycc_counters")
+    counters_ir.initializer = ir.Constant(counters_type, None)
+
+    for fn in functions:
+        blocks = dict([(block.name, block) for block in fn.ir.blocks])
+        for counter in fn.counters:
+            block = blocks[counter.block]
+            # Insert after the phis, if any
+            first_instr = [instr for instr in block.instructions if (instr.opname != "phi")][0]
+            builder = ir.IRBuilder(block)
+            builder.position_before(first_instr)
+            counter_ptr = builder.gep(counters_ir,
+                [ir.IntType(32)(0), ir.IntType(32)(counter.index)], True)
+            builder.atomic_rmw("add", counter_ptr, ir.IntType(64)(1), "monotonic")
 
+        fn.llvm_irs = str(fn.ir).splitlines()
 
-        llvm.set_option('', '--x86-asm-syntax=intel')
+    return counters
 
-        # All these initializations are required for code generation
+
+def get_source_hash(source):
+    return hashlib.sha1(source).hexdigest()
+
+def get_libs_key(libs):
+    """
+    Hashable key of the libraries passed to epycc_compile(..., libs=...) from
+    their sources and compile options, including the libraries they link
+    """
+    if (libs is None):
+        return None
+    return tuple([(get_source_hash(lib.source), json.dumps(lib.options, sort_keys=True), 
+        get_libs_key(lib.libs)) for lib in libs])
+
+def save_profile(profile, filepath):
+    with open(filepath, "w") as f:
+        json.dump(profile, f, indent=2, sort_keys=True)
+
+def load_profile(filepath):
+    with open(filepath, "r") as f:
+        return json.load(f)
+
+def get_edge_counts(function_ir, block_counts):
+    """
+    Return a dict with the execution count of each control flow edge of the
+    function, by (source block name, successor index), derived from the block
+    counts.
+
+    The destination block count can't be used as the count of the edge since
+    blocks can have several predecessors (eg the join block of an if without
+    else). Instead, the edges are solved from the flow constraints
+    - the outgoing edges of a block add up to the block count
+    - the incoming edges of a block add up to the block count (the entry
+      block has no incoming edges)
+    solving any constraint with a single unknown edge until no more edges can
+    be solved. Edges that can't be solved are not returned.
+    """
+    constraints = []
+    incoming = dict()
+    for block in function_ir.blocks:
+        terminator = block.terminator
+        if ((terminator is None) or (terminator.opname != "br")):
+            continue
+        # Unconditional branches have the target as operand, conditional
+        # branches have the condition and both targets
+        targets = terminator.operands[-2:] if (len(terminator.operands) == 3) else terminator.operands
+        edges = [(block.name, i) for i in xrange(len(targets))]
+        if (block.name in block_counts):
+            constraints.append((edges, block_counts[block.name]))
+        for edge, target in zip(edges, targets):
+            incoming.setdefault(target.name, []).append(edge)
+
+    for block_name, edges in incoming.iteritems():
+        if (block_name in block_counts):
+            constraints.append((edges, block_counts[block_name]))
+
+    edge_counts = dict()
+    solved = True
+    while (solved):
+        solved = False
+        for edges, count in constraints:
+            unknown_edges = [edge for edge in edges if (edge not in edge_counts)]
+            if (len(unknown_edges) == 1):
+                edge_counts[unknown_edges[0]] = count - sum(
+                    [edge_counts[edge] for edge in edges if (edge in edge_counts)])
+                solved = True
+
+    return edge_counts
+
+def generate_profile_ir(generator, profile):
+    """
+    Annotate the functions with the execution counts of a profile collected
+    from an instrumented compilation of the same source (see
+    JitLib.get_profile):
+    - conditional branches get !prof branch_weights from the counts of their
+      edges, see get_edge_counts
+    - functions get !prof function_entry_count from the entry block count
+    - the module gets a ProfileSummary so the pass manager considers the
+      profile when classifying hot and cold functions and call sites
+
+    The profile is matched to the generated IR by function and block names,
+    which are deterministic for a given source.
+    """
+    module = generator.llvmir.module
+    all_counts = []
+    num_functions = 0
+    max_function_count = 0
+
+    for sym in generator.symbol_table.values():
+        if ((sym.type != "function") or (not hasattr(sym, "llvm_irs"))):
+            continue
+        function_profile = profile["functions"].get(sym.name, None)
+        if (function_profile is None):
+            continue
+        block_counts = function_profile["blocks"]
+        entry_count = function_profile["entry_count"]
+
+        num_functions += 1
+        max_function_count = max(max_function_count, entry_count)
+        all_counts.extend(block_counts.values())
+
+        edge_counts = get_edge_counts(sym.ir, block_counts)
+        for block in sym.ir.blocks:
+            terminator = block.terminator
+            # Conditional branches have the condition and both targets as
+            # operands
+            if ((terminator is None) or (terminator.opname != "br") or
+                (len(terminator.operands) != 3)):
+                continue
+            edge_true = edge_counts.get((block.name, 0), None)
+            edge_false = edge_counts.get((block.name, 1), None)
+            if ((edge_true is None) or (edge_false is None)):
+                continue
+            # Weights are 32-bit, scale down if necessary. Add one as clang
+            # does so never executed branches are not weighted 0
+            weights = [max(0, edge_true) + 1, max(0, edge_false) + 1]
+            scale = max(1, (max(weights) + 0x7fffffff - 1) / 0x7fffffff)
+            terminator.set_weights([weight / scale for weight in weights])
+
+        sym.entry_count_md = module.add_metadata([
+            ir.MetaDataString(module, "function_entry_count"),
+            ir.IntType(64)(entry_count)
+        ])
+
+        sym.llvm_irs = str(sym.ir).splitlines()
+
+    if (len(all_counts) == 0):
+        return
+
+    # Build the ProfileSummary module flag, see llvm/IR/ProfileSummary.h
+    # The detailed summary contains for each cutoff (in parts per million of
+    # the total count) the minimum count that needs to be added, in descending
+    # order, to reach the cutoff and the number of counts added
+    all_counts.sort(reverse=True)
+    total_count = sum(all_counts)
+    detailed_summary = []
+    for cutoff in [10000, 100000, 200000, 300000, 400000, 500000, 600000,
+        700000, 800000, 900000, 950000, 990000, 999000, 999900, 999990, 999999]:
+        accumulated = 0
+        num_counts = 0
+        min_count = 0
+        for count in all_counts:
+            if (accumulated * 1000000 >= total_count * cutoff):
+                break
+            accumulated += count
+            num_counts += 1
+            min_count = count
+        detailed_summary.append(module.add_metadata([
+            ir.IntType(32)(cutoff), ir.IntType(64)(min_count), ir.IntType(32)(num_counts)
+        ]))
+
+    def summary_entry(key, value):
+        return module.add_metadata([ir.MetaDataString(module, key), value])
+
+    summary = module.add_metadata([
+        module.add_metadata([ir.MetaDataString(module, "ProfileFormat"), ir.MetaDataString(module, "InstrProf")]),
+        summary_entry("TotalCount", ir.IntType(64)(total_count)),
+        summary_entry("MaxCount", ir.IntType(64)(all_counts[0])),
+        summary_entry("MaxInternalCount", ir.IntType(64)(all_counts[0])),
+        summary_entry("MaxFunctionCount", ir.IntType(64)(max_function_count)),
+        summary_entry("NumCounts", ir.IntType(64)(len(all_counts))),
+        summary_entry("NumFunctions", ir.IntType(64)(num_functions)),
+        summary_entry("DetailedSummary", module.add_metadata(detailed_summary)),
+    ])
+    # Module flag behavior 1 is Error (error if two modules being linked have
+    # different values)
+    module.add_named_metadata("llvm.module.flags", [
+        ir.IntType(32)(1), ir.MetaDataString(module, "ProfileSummary"), summary
+    ])
+
+
+# Arena runtime linked into the modules compiled with arena=True, the arena
+# is a pointer to an ArenaHeader. Allocations are 16-byte aligned bumps of the
+# used counter, a null arena or an exhausted arena return null so the caller
+# can fall back to the stack, see generate_arena_alloc_ir
+arena_runtime_ir = """
+define i8* @epycc_arena_alloc(i8* %arena, i64 %size) {
+entry:
+  %isnull = icmp eq i8* %arena, null
+  br i1 %isnull, label %fail, label %check
+check:
+  %header = bitcast i8* %arena to i64*
+  %usedptr = getelementptr i64, i64* %header, i64 1
+  %capacityptr = getelementptr i64, i64* %header, i64 2
+  %peakptr = getelementptr i64, i64* %header, i64 3
+  %used = load i64, i64* %usedptr
+  %capacity = load i64, i64* %capacityptr
+  %padded = add i64 %size, 15
+  %aligned = and i64 %padded, -16
+  %newused = add i64 %used, %aligned
+  %small = icmp ule i64 %size, %capacity
+  %inside = icmp ule i64 %newused, %capacity
+  %fits = and i1 %small, %inside
+  br i1 %fits, label %alloc, label %fail
+alloc:
+  store i64 %newused, i64* %usedptr
+  %peak = load i64, i64* %peakptr
+  %ispeak = icmp ugt i64 %newused, %peak
+  %newpeak = select i1 %ispeak, i64 %newused, i64 %peak
+  store i64 %newpeak, i64* %peakptr
+  %baseptr = bitcast i8* %arena to i8**
+  %base = load i8*, i8** %baseptr
+  %ptr = getelementptr i8, i8* %base, i64 %used
+  ret i8* %ptr
+fail:
+  ret i8* null
+}
+
+define i64 @epycc_arena_mark(i8* %arena) {
+entry:
+  %isnull = icmp eq i8* %arena, null
+  br i1 %isnull, label %done, label %mark
+mark:
+  %header = bitcast i8* %arena to i64*
+  %usedptr = getelementptr i64, i64* %header, i64 1
+  %used = load i64, i64* %usedptr
+  ret i64 %used
+done:
+  ret i64 0
+}
+
+define void @epycc_arena_release(i8* %arena, i64 %mark) {
+entry:
+  %isnull = icmp eq i8* %arena, null
+  br i1 %isnull, label %done, label %release
+release:
+  %header = bitcast i8* %arena to i64*
+  %usedptr = getelementptr i64, i64* %header, i64 1
+  store i64 %mark, i64* %usedptr
+  ret void
+done:
+  ret void
+}
+"""
+
+def get_object_code_sizes(object_code):
+    """
+    Return the code and data bytes that loading the object code takes in
+    memory
+    """
+    # Sections that get loaded in memory, other than the code (ELF and COFF
+    # names)
+    data_section_prefixes = (".data", ".rodata", ".rdata", ".bss", ".tdata",
+        ".tbss", ".eh_frame", ".xdata", ".pdata")
+    code_bytes = 0
+    data_bytes = 0
+    if (object_code != ""):
+        for section in llvm.ObjectFileRef.from_data(object_code).sections():
+            if (section.is_text()):
+                code_bytes += section.size()
+            elif (section.name().startswith(data_section_prefixes)):
+                data_bytes += section.size()
+
+    return code_bytes, data_bytes
+
+class JitLib(Struct):
+    """
+    Library of JIT compiled functions returned by epycc_compile, the C
+    functions are exposed as attributes
+    """
+    def close(self):
+        """
+        Free the JIT memory used by the library, the library's functions
+        raise if called afterwards.
+
+        Note any ctypes function pointers or counters obtained from the
+        library before closing point to freed memory and must not be used
+        """
+        if (self.engine is None):
+            return
+
+        for function_name in self.function_names:
+            closed = functools.partial(closed_function, function_name)
+            setattr(self, function_name, closed)
+            setattr(self, "__raw_" + function_name, closed)
+        self.counters = None
+
+        if (self.mod is not None):
+            self.engine.remove_module(self.mod)
+            self.mod.close()
+        # Closing the engine frees the JIT memory
+        self.engine.close()
+        self.tm.close()
+        self.engine = None
+        self.mod = None
+        self.tm = None
+
+    def is_closed(self):
+        return (self.engine is None)
+
+    def __enter__(self):
+        return self
+
+    def __exit__(self, exc_type, exc_value, traceback):
+        self.close()
+
+    def get_profile(self):
+        """
+        Return the execution profile collected by the counters of an
+        instrumented library as a json-serializable dict, see save_profile and
+        load_profile
+        """
+        assert self.counters is not None, "Library needs to be compiled with instrument=True"
+
+        functions = dict()
+        for counter in self.counter_info:
+            function_profile = functions.setdefault(counter.function, 
+                dict(entry_count=0, blocks=dict()))
+            count = int(self.counters[counter.index])
+            function_profile["blocks"][counter.block] = count
+            if (counter.kind == "function"):
+                function_profile["entry_count"] = count
+
+        return dict(source_hash=get_source_hash(self.source), functions=functions)
+
+    def __getstate__(self):
+        """
+        Pickle the library as its object code so it can be sent to other
+        processes and loaded there without recompiling, see llvm_load
+        """
+        assert not self.is_closed(), "Can't pickle a closed library"
+
+        return dict(
+            object_code = self.object_code,
+            function_signatures = encode_function_signatures(self.function_signatures),
+            latency = self.latency_enabled,
+            source = getattr(self, "source", None),
+            codegen_options = getattr(self, "codegen_options", dict()),
+        )
+
+    def __setstate__(self, state):
+        function_signatures = decode_function_signatures(state["function_signatures"])
+        llvm_load(state["object_code"], function_signatures, state["latency"], self)
+        self.source = state["source"]
+        self.codegen_options = state["codegen_options"]
+
+    def save(self, filepath):
+        """
+        Save the library as a shared object plus a filepath + ".json" metadata
+        sidecar with the function signatures, so it can be loaded with
+        epyccrt.load_lib without lark, llvmlite or any JIT compilation.
+
+        The shared object is linked with the C compiler in the CC environment
+        variable, cc by default
+        """
+        assert not self.is_closed(), "Can't save a closed library"
+        assert self.mod is not None, "Can't save a library loaded from object code"
+
+        link_shared_object(self.mod, filepath)
+
+        with open(filepath + ".json", "w") as f:
+            json.dump(dict(
+                function_signatures = encode_function_signatures(self.function_signatures),
+                latency = self.latency_enabled,
+            ), f, indent=2, sort_keys=True)
+
+    def reoptimize_with_profile(self, profile = None, instrument = False):
+        """
+        Recompile the library's source using the given profile, or the one
+        collected so far by this library's counters if None.
         
-        llvm.initialize()
-        llvm.initialize_native_target()
-        llvm.initialize_native_asmprinter()  # yes, even this one
+        Returns the new library, this library is left untouched
+        """
+        if (profile is None):
+            profile = self.get_profile()
 
-        llvm_initialized = True
+        return epycc_compile(self.source, instrument=instrument, profile=profile, 
+            libs=getattr(self, "libs", None), **self.codegen_options)
 
-        # XXX Reuse some of the objects created below across llvm_compile 
-        #     invocations?
 
-    def create_target_machine():
-        # Create a target machine representing the host
-        target = llvm.Target.from_default_triple()
-        target_machine = target.create_target_machine()
+class JitLibCache:
+    """
+    Cache of compiled libraries keyed by source and compile options, with a
+    least recently used eviction policy that keeps the JIT memory used by the
+    cached libraries under max_bytes.
 
-        return target_machine
+    Evicted libraries are closed, so users must not hold on to libraries
+    returned by the cache across get calls, or set max_bytes high enough
+    """
+    def __init__(self, max_bytes):
+        self.max_bytes = max_bytes
+        self.total_bytes = 0
+        self.libs = odict()
+        self.hits = 0
+        self.misses = 0
+
+    def get(self, source, **options):
+        """
+        Return the library for the given source and epycc_compile options,
+        compiling it if not in the cache
+        """
+        # The linked libraries are not serializable, key them by source and
+        # options
+        key_options = dict(options)
+        libs_key = get_libs_key(key_options.pop("libs", None))
+        key = (get_source_hash(source), json.dumps(key_options, sort_keys=True), libs_key)
+        lib = self.libs.pop(key, None)
+        if (lib is None):
+            self.misses += 1
+            lib = epycc_compile(source, **options)
+            self.total_bytes += lib.code_bytes + lib.data_bytes
+        else:
+            self.hits += 1
+
+        # Most recently used go last
+        self.libs[key] = lib
+        self.evict(self.max_bytes)
 
-    def create_execution_engine(target_machine):
+        return lib
+
+    def evict(self, max_bytes):
+        """
+        Close and remove least recently used libraries until the total memory
+        is under max_bytes, the most recently used library is never evicted
+        """
+        while ((self.total_bytes > max_bytes) and (len(self.libs) > 1)):
+            key, lib = self.libs.popitem(last=False)
+            self.total_bytes -= lib.code_bytes + lib.data_bytes
+            lib.close()
+
+    def clear(self):
+        self.evict(0)
+        for lib in self.libs.values():
+            lib.close()
+        self.libs.clear()
+        self.total_bytes = 0
+
+class SharedArg(Struct):
+    """
+    Reference to one of the shared arrays of a JitPool, offset is in
+    elements
+    """
+    def __init__(self, name, offset = 0):
+        Struct.__init__(self, name = name, offset = offset)
+
+# Library and shared arrays of the JitPool worker process, see jit_pool_init
+jit_pool_lib = None
+jit_pool_arrays = None
+
+def jit_pool_init(pickled_lib, shared_arrays):
+    global jit_pool_lib, jit_pool_arrays
+    # Load the library from its object code, no parsing or optimizing happens
+    # in the workers
+    jit_pool_lib = cPickle.loads(pickled_lib)
+    jit_pool_arrays = shared_arrays
+
+def jit_pool_resolve_arg(arg):
+    if (isinstance(arg, SharedArg)):
+        arr = jit_pool_arrays[arg.name]
+        if (arg.offset != 0):
+            arr = ctypes.cast(ctypes.byref(arr, arg.offset * ctypes.sizeof(arr._type_)), 
+                ctypes.POINTER(arr._type_))
+        arg = arr
+
+    return arg
+
+def jit_pool_call(function_name, args):
+    args = [jit_pool_resolve_arg(arg) for arg in args]
+    return getattr(jit_pool_lib, function_name)(*args)
+
+def jit_pool_star_call(function_name_args):
+    return jit_pool_call(*function_name_args)
+
+class JitPool:
+    """
+    Pool of worker processes calling the functions of a compiled library.
+
+    The library is sent to the workers as its object code so they don't parse
+    or optimize. shared_arrays is a dict of name to
+    multiprocessing.sharedctypes.RawArray created before the pool, the arrays
+    are inherited by the workers and passed as zero-copy arguments by using
+    SharedArg(name, offset) in the call arguments, results written to them are
+    visible to the parent
+    """
+    def __init__(self, lib, processes = None, shared_arrays = None):
+        if (shared_arrays is None):
+            shared_arrays = dict()
+        self.shared_arrays = shared_arrays
+        self.pool = multiprocessing.Pool(processes, jit_pool_init, 
+            (cPickle.dumps(lib, cPickle.HIGHEST_PROTOCOL), shared_arrays))
+
+    def apply(self, function_name, *args):
+        return self.pool.apply(jit_pool_call, (function_name, args))
+
+    def apply_async(self, function_name, *args):
+        return self.pool.apply_async(jit_pool_call, (function_name, args))
+
+    def map(self, function_name, args_list):
+        """
+        Call function_name once per tuple of arguments in args_list, returns
+        the list of results
+        """
+        return self.pool.map(jit_pool_star_call, 
+            [(function_name, tuple(args)) for args in args_list])
+
+    def close(self):
+        self.pool.close()
+
+    def join(self):
+        self.pool.join()
+
+    def terminate(self):
+        self.pool.terminate()
+
+    def __enter__(self):
+        return self
+
+    def __exit__(self, exc_type, exc_value, traceback):
+        self.terminate()
+
+
+llvm_initialized = False
+
+def llvm_initialize():
+    global llvm_initialized
+    with init_lock:
+        if (not llvm_initialized):
+            # This switches the assembler emit from at&t to intel, needs to be done
+            # before initializing llvmlite, otherwise it's ignored
+            # Will also give a warning
+            #       "for the -x86-asm-syntax option: may only occur zero or one times!"
+            # when llvm_compile is initialized more than once (but other than that
+            # multiple initialization doesn't seem to be a problem)
+    
+            # XXX This probably doesn't affect the input assembler, only the output, which
+            #     has to be done in AT&T eg
+            #       call void asm sideeffect "movl %eax, %eax", "~{dirflag},~{fpsr},~{flags}"() #2
+
+
+            llvm.set_option('', '--x86-asm-syntax=intel')
+
+            # All these initializations are required for code generation
+        
+            llvm.initialize()
+            llvm.initialize_native_target()
+            llvm.initialize_native_asmprinter()  # yes, even this one
+
+            llvm_initialized = True
+
+            # XXX Reuse some of the objects created below across llvm_compile 
+            #     invocations?
+
+def create_target_machine():
+    # Create a target machine representing the host
+    target = llvm.Target.from_default_triple()
+    target_machine = target.create_target_machine()
+
+    return target_machine
+
+def create_pass_manager_builder(opt=2, loop_vectorize=False,
+                                slp_vectorize=False):
+    # See https://github.com/numba/llvmlite/blob/master/llvmlite/llvmpy/passes.py
+    def _inlining_threshold(optlevel, sizelevel=0):
+        # Refer http://llvm.org/docs/doxygen/html/InlineSimple_8cpp_source.html
+        if optlevel > 2:
+            return 275
+
+        # -Os
+        if sizelevel == 1:
+            return 75
+
+        # -Oz
+        if sizelevel == 2:
+            return 25
+
+        return 225
+
+    pmb = llvm.create_pass_manager_builder()
+    pmb.opt_level = opt
+    # XXX Investigate enabling these. At least not disabling loop-vectorize
+    #     in clang command line is known to produce different code for the
+    #     ffact functions.c test
+    pmb.loop_vectorize = loop_vectorize
+    pmb.slp_vectorize = slp_vectorize
+    # XXX An inlining threshold of 20 is enough to inline the utility
+    #     functions and generates closer code to clang -O2 in one single
+    #     case fsum_indirect2, since otherwise epycc does one final call
+    #     recursion elimintion that clang doesn't do
+    pmb.inlining_threshold = _inlining_threshold(opt)
+
+    return pmb
+
+def link_libs(mod, libs):
+    """
+    Link the IR of the libraries into the module before it's optimized, so the
+    module's functions can call and inline the libraries' functions.
+
+    The functions exposed by the libraries are linked as linkonce_odr so they
+    can be inlined and discarded if unused, the rest of their functions and
+    globals (internal snippets, counters...) as internal so they don't clash
+    with the module's
+    """
+    # The module's functions would silently replace the libraries' functions
+    # with the same name (and the first library's function the others'),
+    # since they are linkonce_odr
+    defined_names = set([func.name for func in mod.functions if (not func.is_declaration)])
+    for lib in libs:
+        assert lib.ir is not None, "Can't link libraries loaded from object code"
+        lib_mod = llvm.parse_assembly(lib.ir)
+        function_names = set(lib.function_names)
+        colliding_names = defined_names & function_names
+        if (len(colliding_names) > 0):
+            raise ValueError("Functions %s defined in more than one library or the source" % 
+                string.join(sorted(colliding_names), ", "))
+        defined_names |= function_names
+        for func in lib_mod.functions:
+            if (not func.is_declaration):
+                func.linkage = "linkonce_odr" if (func.name in function_names) else "internal"
+        for global_variable in lib_mod.global_variables:
+            if (not global_variable.is_declaration):
+                global_variable.linkage = "internal"
+        mod.link_in(lib_mod)
+
+    for func in mod.functions:
+        assert (not func.is_declaration) or func.name.startswith("llvm."), \
+            "Undefined function %s, pass the library defining it in libs" % func.name
+
+def llvm_compile(llvm_ir, function_signatures, latency = False, libs = None):
+    llvm_initialize()
+
+    def create_execution_engine(target_machine, object_codes):
         """
         Create an ExecutionEngine suitable for JIT code generation on
         the host CPU.  The engine is reusable for an arbitrary number of
         modules.
+
+        The object code of the modules compiled by the engine is appended to
+        object_codes
         """
         # And an execution engine with an empty backing module
         backing_mod = llvm.parse_assembly("")
         engine = llvm.create_mcjit_compiler(backing_mod, target_machine)
 
         save_module_obj = False
-        if (save_module_obj):
-            # This gets called by LLVM when a module has been compiled and it's
-            # passed the object code that can be disassembled via objdump -d
-            # It gets called at engine.finalize_object time, and only once and
-            # for the last compilation (unoptimized or optimized)
-            def on_compiled(module, objbytes):
+
+        # This gets called by LLVM when a module has been compiled and it's
+        # passed the object code that can be disassembled via objdump -d
+        # It gets called at engine.finalize_object time, and only once and
+        # for the last compilation (unoptimized or optimized)
+        def on_compiled(module, objbytes):
+            object_codes.append(objbytes)
+            if (save_module_obj):
                 count = getattr(on_compiled, "count", 0)
                 open(os.path.join("_out", os.path.basename(__file__) + '-%03d.o' % count), 'wb').write(objbytes)
                 count += 1
                 on_compiled.count = count
 
-            # set_object_cache can also be used to inject binaries in the 
-            # cache by defining the second function object_cache_get_buffer
-            engine.set_object_cache(on_compiled, lambda m: None)
+        # set_object_cache can also be used to inject binaries in the 
+        # cache by defining the second function object_cache_get_buffer
+        engine.set_object_cache(on_compiled, lambda m: None)
             
         return engine
 
@@ -2617,43 +4008,14 @@ def llvm_compile(llvm_ir, function_signatures):
         
         return mod
 
-    def create_pass_manager_builder(opt=2, loop_vectorize=False,
-                                    slp_vectorize=False):
-        # See https://github.com/numba/llvmlite/blob/master/llvmlite/llvmpy/passes.py
-        def _inlining_threshold(optlevel, sizelevel=0):
-            # Refer http://llvm.org/docs/doxygen/html/InlineSimple_8cpp_source.html
-            if optlevel > 2:
-                return 275
-
-            # -Os
-            if sizelevel == 1:
-                return 75
-
-            # -Oz
-            if sizelevel == 2:
-                return 25
-
-            return 225
-
-        pmb = llvm.create_pass_manager_builder()
-        pmb.opt_level = opt
-        # XXX Investigate enabling these. At least not disabling loop-vectorize
-        #     in clang command line is known to produce different code for the
-        #     ffact functions.c test
-        pmb.loop_vectorize = loop_vectorize
-        pmb.slp_vectorize = slp_vectorize
-        # XXX An inlining threshold of 20 is enough to inline the utility
-        #     functions and generates closer code to clang -O2 in one single
-        #     case fsum_indirect2, since otherwise epycc does one final call
-        #     recursion elimintion that clang doesn't do
-        pmb.inlining_threshold = _inlining_threshold(opt)
-
-        return pmb
-
-    jit_lib = Struct(ir = llvm_ir)
+    jit_lib = JitLib(ir = llvm_ir)
 
     target_machine = create_target_machine()
     mod = compile_ir(llvm_ir)
+    if (libs is not None):
+        link_libs(mod, libs)
+        # Keep the linked IR so this library can be linked in turn
+        jit_lib.ir = str(mod)
 
     # XXX All the attributes should probably go under some safe prefix to
     #     prevent from colliding with the user-defined functions that are being
@@ -2696,7 +4058,8 @@ def llvm_compile(llvm_ir, function_signatures):
     #     optimized IR, the optimized IR changes subtly enough (getelementptr
     #     changed to bitcast) to fail the 2d_to_1d array tests and others,
     #     investigate?
-    engine = create_execution_engine(target_machine)
+    object_codes = []
+    engine = create_execution_engine(target_machine, object_codes)
     engine.add_module(mod)
     # Finalize the object, this will cause the compile notify callbacks in the
     # object cache to be triggered
@@ -2704,134 +4067,687 @@ def llvm_compile(llvm_ir, function_signatures):
     # XXX Not clear this is the right place to run the static constructors?
     engine.run_static_constructors()
 
+    if (output_optimized_dot):
+        for function_signature in function_signatures:
+            func = mod.get_function(function_signature.name)
+            dot = llvm.get_function_cfg(func, show_inst=True)
+            dot_filepath = os.path.join(os.path.dirname(os.path.abspath(__file__)), "_out", function_signature.name + ".optimized.dot")
+            with open(dot_filepath, "w") as f:
+                f.write(dot)
+            invoke_dot(dot_filepath)
+
     # XXX Need to keep some of these around to prevent access violations when
     #     calling the function right after leaving this function, presumably
     #     because of garbage collection, find out which ones
     jit_lib.mod = mod
     jit_lib.tm = target_machine
     jit_lib.engine = engine
-    
-    for function_signature in function_signatures:
-
-        # Look up the function pointer (a Python int)
-        func_ptr = engine.get_function_address(function_signature.name)
 
-        if (output_optimized_dot):
-            func = mod.get_function(function_signature.name)
-            dot = llvm.get_function_cfg(func, show_inst=True)
-            dot_filepath = os.path.join(os.path.dirname(os.path.abspath(__file__)), "_out", function_signature.name + ".optimized.dot")
-            with open(dot_filepath, "w") as f:
-                f.write(dot)
-            invoke_dot(dot_filepath)
+    # Account for the JIT memory used by the library
+    jit_lib.object_code = string.join(object_codes, "")
 
-        # Obtain a pointer to the function via ctypes
-        cfunc = ctypes.CFUNCTYPE(*function_signature.ctypes)(func_ptr)
-        raw_cfunc = cfunc
+    publish_functions(jit_lib, function_signatures, latency)
         
-        # Convert the Python arguments to ctype arguments by wrapping the ctype
-        # function in a Python wrapper
-        if (any(
-                [(issubclass(ctype, ctypes.Array) or issubclass(ctype, ctypes._Pointer)) 
-                for ctype in function_signature.ctypes[1:]]
-            )):
-            # Nested lists need to be converted to nested tuples
-            def wrapper(_cfunc, *args):
-                def tuplize(a):
-                    # XXX This assumes that once it finds a tuple everything 
-                    #     is tuples all the way
-                    if (isinstance(a, list)):
-                        l = []
-                        for i in a:
-                            l.append(tuplize(i))
-                        return tuple(l)
-                    else:
-                        return a
+    return jit_lib
 
-                _args = []
-                
-                for arg, ctype in zip(args, _cfunc.argtypes):
-                    if (issubclass(ctype, ctypes.Array)):
-                        # Pass the list straight
-                        _args.append(ctype(*tuplize(arg)))
+def llvm_load(object_code, function_signatures, latency = False, jit_lib = None):
+    """
+    Load the object code of a library compiled by llvm_compile without
+    parsing, generating or optimizing, see JitLib.__getstate__
 
-                    elif (issubclass(ctype, ctypes._Pointer)):
-                        # Pointer to array, ignore the pointer, pass an array
-                        tup = tuplize(arg)
-                        c_arr = (len(tup) * ctype._type_)(*tup)
-                        _args.append(c_arr)
+    Returns a new JitLib, or jit_lib if not None. The IR and assembly of the
+    library are not available
+    """
+    llvm_initialize()
 
-                    else:
-                        _args.append(ctype(arg))
+    if (jit_lib is None):
+        jit_lib = JitLib()
+    jit_lib.ir = None
+    jit_lib.ir_optimized = None
+    jit_lib.asm = None
+    jit_lib.asm_optimized = None
 
-                # Invoke the function
-                res = _cfunc(*_args)
-                
-                # copy back
-                for arg, ctype, _arg in zip(args, _cfunc.argtypes, _args):
-                    if (issubclass(ctype, ctypes.Array)):
-                        assert False, "Missing copy back for array"
-
-                    elif (issubclass(ctype, ctypes._Pointer)):
-                        def deepcopy_list(l, c_arr):
-                            for i in xrange(len(l)):
-                                if (isinstance(l[i], list)):
-                                    deepcopy_list(l[i], c_arr[i])
-                                else:
-                                    l[i] = c_arr[i]
-
-                        # Can't copy back tuples, only lists
-                        # XXX This assumes that there are no lists if the 
-                        #     topmost is not list
-                        if (isinstance(arg, list)):
-                            deepcopy_list(arg, _arg)
-
-                    # XXX Other copybacks probably missing like structs, etc
-                    #     May go through the pointer path?
-                return res
-
-            # XXX Ideally this hould only override the __call__ so the 
-            #     user still sees a ctypes function
-            cfunc = functools.partial(wrapper, cfunc)
-        
-        setattr(jit_lib, function_signature.name, cfunc)
-        setattr(jit_lib, "__raw_" + function_signature.name, raw_cfunc)
+    target_machine = create_target_machine()
+    # The backing module is owned by the engine
+    engine = llvm.create_mcjit_compiler(llvm.parse_assembly(""), target_machine)
+    engine.add_object_file(llvm.ObjectFileRef.from_data(object_code))
+    engine.finalize_object()
+    engine.run_static_constructors()
+
+    jit_lib.mod = None
+    jit_lib.tm = target_machine
+    jit_lib.engine = engine
+    jit_lib.object_code = object_code
+
+    publish_functions(jit_lib, function_signatures, latency)
 
-    # XXX Missing publishing the globals once there's global support
-        
     return jit_lib
 
+def publish_functions(jit_lib, function_signatures, latency):
+    """
+    Expose the functions and counters of the library's engine as jit_lib
+    attributes, see epyccrt.bind_functions
+    """
+    engine = jit_lib.engine
+    jit_lib.code_bytes, jit_lib.data_bytes = get_object_code_sizes(jit_lib.object_code)
 
-def load_functions_ir(ir_filepath):
+    bind_functions(jit_lib, function_signatures, latency, engine.get_function_address,
+        engine.get_global_value_address)
+
+def link_shared_object(mod, filepath, c_filepaths = [], cflags = []):
+    """
+    Emit the module as position independent object code and link it into the
+    shared object filepath, together with the given C files.
+
+    The C compiler is the one in the CC environment variable, cc by default
+    """
+    # Shared objects need position independent code, which the JIT target
+    # machine doesn't generate
+    target = llvm.Target.from_default_triple()
+    target_machine = target.create_target_machine(reloc="pic", codemodel="default")
+    object_filepath = filepath + ".o"
+    with open(object_filepath, "wb") as f:
+        f.write(target_machine.emit_object(mod))
+    try:
+        subprocess.check_call([os.environ.get("CC", "cc"), "-shared", "-fPIC", "-o", 
+            filepath] + cflags + c_filepaths + [object_filepath])
+    finally:
+        os.remove(object_filepath)
+
+# C type and Python conversion kind of the scalar ctypes, used to generate
+# the CPython extension wrappers. Note some ctypes are aliases of others of
+# the same size (eg c_longlong of c_long in LP64), which is fine since only
+# the size matters for the calls
+ctype_c_types = dict([
+    (ctypes.c_longdouble, ("long double", "float")),
+    (ctypes.c_double, ("double", "float")),
+    (ctypes.c_float, ("float", "float")),
+    (ctypes.c_longlong, ("long long", "signed")),
+    (ctypes.c_ulonglong, ("unsigned long long", "unsigned")),
+    (ctypes.c_long, ("long", "signed")),
+    (ctypes.c_ulong, ("unsigned long", "unsigned")),
+    (ctypes.c_int, ("int", "signed")),
+    (ctypes.c_uint, ("unsigned int", "unsigned")),
+    (ctypes.c_short, ("short", "signed")),
+    (ctypes.c_ushort, ("unsigned short", "unsigned")),
+    (ctypes.c_char, ("char", "char")),
+    (ctypes.c_byte, ("signed char", "signed")),
+    (ctypes.c_ubyte, ("unsigned char", "unsigned")),
+    (ctypes.c_bool, ("_Bool", "bool")),
+])
+
+# Buffer protocol format codes (struct module syntax) of the items that can be
+# passed to arrays of each conversion kind, the item size is checked
+# separately. Byte buffers can be passed to any char array, see byte_ctypes
+buffer_format_codes = dict(
+    float = "fdg",
+    signed = "bhilqn",
+    unsigned = "BHILQN",
+    bool = "?",
+    char = "cbB",
+)
+
+def generate_extension_c(module_name, function_signatures):
+    """
+    Return the C source of a CPython extension module exposing the functions
+    with the given signatures, which must be linked in the same shared object.
+
+    Scalars are unboxed directly from Python ints, floats and one character
+    strings (floats are rejected for integer parameters), arrays are taken
+    from objects supporting the buffer protocol (bytearray, numpy arrays...)
+    with the same item format without copying. Char arrays also accept
+    objects with the old-style buffer interface only, like mmaps. The GIL is
+    released during the calls
+    """
+    c_lines = [
+        "/* Generated by epycc, do not edit */",
+        "#include <Python.h>",
+        "",
+        "/* Return 1 if the buffer items are in native byte order and have one of",
+        "   the format codes */",
+        "static int epycc_check_format(Py_buffer* b, const char* codes)",
+        "{",
+        '    const char* format = (b->format == NULL) ? "B" : b->format;',
+        "    if ((format[0] == '@') || (format[0] == '=') || (format[0] == '%s')) {" % (
+            "<" if (sys.byteorder == "little") else ">"),
+        "        format++;",
+        "    }",
+        "    return (format[0] != '\\0') && (format[1] == '\\0') && (strchr(codes, format[0]) != NULL);",
+        "}",
+        "",
+    ]
+    method_lines = []
+
+    for function_signature in function_signatures:
+        assert not function_signature.arena, "Arena functions not supported in extensions"
+        assert not any(function_signature.strided), "Strided array parameters not supported in extensions"
+        name = function_signature.name
+        res_ctype = function_signature.ctypes[0]
+        param_ctypes = function_signature.ctypes[1:]
+        
+        if (res_ctype is None):
+            res_c_type = "void"
+        else:
+            res_c_type = ctype_c_types[res_ctype][0]
+
+        # Declare the function compiled by epycc, arrays are passed as
+        # pointers
+        c_params = []
+        for ctype in param_ctypes:
+            if (issubclass(ctype, (ctypes.Array, ctypes._Pointer))):
+                c_params.append("void*")
+            else:
+                c_params.append(ctype_c_types[ctype][0])
+        c_lines.append("extern %s %s(%s);" % (res_c_type, name, 
+            string.join(c_params, ", ") if (len(c_params) > 0) else "void"))
+        c_lines.append("")
+
+        c_lines.append("static PyObject* epycc_py_%s(PyObject* self, PyObject* args)" % name)
+        c_lines.append("{")
+        c_lines.append("    PyObject* res = NULL;")
+        for i, ctype in enumerate(param_ctypes):
+            c_lines.append("    PyObject* o%d;" % i)
+            if (issubclass(ctype, (ctypes.Array, ctypes._Pointer))):
+                c_lines.append("    Py_buffer b%d;" % i)
+                c_lines.append("    int h%d = 0;" % i)
+            else:
+                c_lines.append("    %s a%d;" % (ctype_c_types[ctype][0], i))
+        if (res_ctype is not None):
+            c_lines.append("    %s r;" % res_c_type)
+        c_lines.append("")
+        c_lines.append('    if (!PyArg_ParseTuple(args, "%s:%s"%s)) {' % ("O" * len(param_ctypes), name, 
+            string.join([", &o%d" % i for i in xrange(len(param_ctypes))], "")))
+        c_lines.append("        return NULL;")
+        c_lines.append("    }")
+
+        for i, ctype in enumerate(param_ctypes):
+            if (issubclass(ctype, (ctypes.Array, ctypes._Pointer))):
+                # Find the element type of the (possibly nested) array
+                elem_ctype = ctype._type_
+                while (issubclass(elem_ctype, ctypes.Array)):
+                    elem_ctype = elem_ctype._type_
+                if (elem_ctype in byte_ctypes):
+                    format_codes = buffer_format_codes["char"]
+                else:
+                    format_codes = buffer_format_codes[ctype_c_types[elem_ctype][1]]
+                c_lines.extend([
+                    "    if (PyObject_GetBuffer(o%d, &b%d, PyBUF_ND | PyBUF_FORMAT | PyBUF_WRITABLE) < 0) {" % (i, i),
+                    "        /* Read-only buffers, the function must not write to them */",
+                    "        PyErr_Clear();",
+                    "        if (PyObject_GetBuffer(o%d, &b%d, PyBUF_ND | PyBUF_FORMAT) < 0) {" % (i, i),
+                ])
+                if (elem_ctype in byte_ctypes):
+                    # Python 2 mmaps only support the old-style buffer
+                    # interface, accept them for char arrays same as the
+                    # ctypes wrappers do
+                    c_lines.extend([
+                        "            void* p%d;" % i,
+                        "            Py_ssize_t n%d;" % i,
+                        "            int read_only%d = 0;" % i,
+                        "            PyErr_Clear();",
+                        "            if (PyObject_AsWriteBuffer(o%d, &p%d, &n%d) < 0) {" % (i, i, i),
+                        "                PyErr_Clear();",
+                        "                if (PyObject_AsReadBuffer(o%d, (const void**) &p%d, &n%d) < 0) {" % (i, i, i),
+                        "                    goto done;",
+                        "                }",
+                        "                read_only%d = 1;" % i,
+                        "            }",
+                        "            PyBuffer_FillInfo(&b%d, o%d, p%d, n%d, read_only%d, PyBUF_ND | PyBUF_FORMAT);" % (
+                            i, i, i, i, i),
+                    ])
+                else:
+                    c_lines.append("            goto done;")
+                c_lines.extend([
+                    "        }",
+                    "    }",
+                    "    h%d = 1;" % i,
+                    '    if ((b%d.itemsize != %d) || !epycc_check_format(&b%d, "%s")) {' % (i, 
+                        ctypes.sizeof(elem_ctype), i, format_codes),
+                    '        PyErr_SetString(PyExc_TypeError, "%s argument %d: expected buffer of %s");' % (
+                        name, i + 1, ctype_c_types[elem_ctype][0]),
+                    "        goto done;",
+                    "    }",
+                ])
+                if (issubclass(ctype, ctypes.Array)):
+                    c_lines.extend([
+                        "    if (b%d.len < %d) {" % (i, ctypes.sizeof(ctype)),
+                        '        PyErr_SetString(PyExc_ValueError, "%s argument %d: buffer too small");' % (name, i + 1),
+                        "        goto done;",
+                        "    }",
+                    ])
+                continue
+
+            c_type, kind = ctype_c_types[ctype]
+            if (kind in ["signed", "unsigned", "char"]):
+                # Don't truncate floats passed to integers, same as ctypes
+                c_lines.extend([
+                    "    if (PyFloat_Check(o%d)) {" % i,
+                    '        PyErr_SetString(PyExc_TypeError, "%s argument %d: expected %s, got float");' % (
+                        name, i + 1, c_type),
+                    "        goto done;",
+                    "    }",
+                ])
+
+            if (kind == "float"):
+                c_lines.extend([
+                    "    a%d = (%s) PyFloat_AsDouble(o%d);" % (i, c_type, i),
+                    "    if ((a%d == -1.0) && PyErr_Occurred()) {" % i,
+                ])
+
+            elif (kind == "bool"):
+                c_lines.extend([
+                    "    a%d = PyObject_IsTrue(o%d);" % (i, i),
+                    "    if (PyErr_Occurred()) {",
+                ])
+
+            elif (kind == "unsigned"):
+                c_lines.extend([
+                    "    a%d = (%s) PyInt_AsUnsignedLongLongMask(o%d);" % (i, c_type, i),
+                    "    if (PyErr_Occurred()) {",
+                ])
+
+            else:
+                if (kind == "char"):
+                    c_lines.extend([
+                        "    if (PyString_Check(o%d) && (PyString_GET_SIZE(o%d) == 1)) {" % (i, i),
+                        "        a%d = PyString_AS_STRING(o%d)[0];" % (i, i),
+                        "    }",
+                        "    else {",
+                        "        a%d = (%s) PyLong_AsLongLong(o%d);" % (i, c_type, i),
+                        "    }",
+                    ])
+
+                else:
+                    c_lines.append("    a%d = (%s) PyLong_AsLongLong(o%d);" % (i, c_type, i))
+                c_lines.append("    if (PyErr_Occurred()) {")
+            c_lines.append("        goto done;")
+            c_lines.append("    }")
+
+        c_args = []
+        for i, ctype in enumerate(param_ctypes):
+            if (issubclass(ctype, (ctypes.Array, ctypes._Pointer))):
+                c_args.append("b%d.buf" % i)
+            else:
+                c_args.append("a%d" % i)
+        c_lines.append("")
+        c_lines.append("    Py_BEGIN_ALLOW_THREADS")
+        c_lines.append("    %s%s(%s);" % ("" if (res_ctype is None) else "r = ", name, string.join(c_args, ", ")))
+        c_lines.append("    Py_END_ALLOW_THREADS")
+        c_lines.append("")
+
+        if (res_ctype is None):
+            c_lines.append("    Py_INCREF(Py_None);")
+            c_lines.append("    res = Py_None;")
+        else:
+            kind = ctype_c_types[res_ctype][1]
+            if (kind == "float"):
+                c_lines.append("    res = PyFloat_FromDouble(r);")
+            elif (kind == "bool"):
+                c_lines.append("    res = PyBool_FromLong(r);")
+            elif (kind == "char"):
+                c_lines.append("    res = PyString_FromStringAndSize(&r, 1);")
+            elif (ctypes.sizeof(res_ctype) < ctypes.sizeof(ctypes.c_long)):
+                c_lines.append("    res = PyInt_FromLong(r);")
+            elif (kind == "unsigned"):
+                c_lines.append("    res = PyLong_FromUnsignedLongLong(r);")
+            elif (ctypes.sizeof(res_ctype) == ctypes.sizeof(ctypes.c_long)):
+                c_lines.append("    res = PyInt_FromLong(r);")
+            else:
+                c_lines.append("    res = PyLong_FromLongLong(r);")
+
+        c_lines.append("")
+        c_lines.append("done:")
+        for i, ctype in enumerate(param_ctypes):
+            if (issubclass(ctype, (ctypes.Array, ctypes._Pointer))):
+                c_lines.append("    if (h%d) {" % i)
+                c_lines.append("        PyBuffer_Release(&b%d);" % i)
+                c_lines.append("    }")
+        c_lines.append("    return res;")
+        c_lines.append("}")
+        c_lines.append("")
+
+        method_lines.append('    { "%s", epycc_py_%s, METH_VARARGS, NULL },' % (name, name))
+
+    c_lines.append("static PyMethodDef epycc_methods[] = {")
+    c_lines.extend(method_lines)
+    c_lines.append("    { NULL, NULL, 0, NULL }")
+    c_lines.append("};")
+    c_lines.append("")
+    c_lines.append("PyMODINIT_FUNC init%s(void)" % module_name)
+    c_lines.append("{")
+    c_lines.append('    Py_InitModule("%s", epycc_methods);' % module_name)
+    c_lines.append("}")
+    c_lines.append("")
+
+    return string.join(c_lines, "\n")
+
+def parse_functions_ir(lines):
     ir_functions = {}
-    with open(ir_filepath, "r") as f:
-        ir_function = None
-        for l in f:
-            # define signext i8 @add__char__char__char(i8 signext, i8 signext) #0 {
-            l = l.strip()
-            if (l.endswith("{")):
-                ir_function = []
-                m = re.search("@([^(]+)", l)
-                function_name = m.group(1)
-
-            if (ir_function is not None):
-                ir_function.append(l)
-
-            # Note clang puts some debug lines that end in }, only deal with }
-            # if we are inside a function
-            if ((ir_function is not None) and (l.endswith("}"))):
-                ir_functions[function_name] = ir_function
-                function_name = None
-                ir_function = None
+    ir_function = None
+    for l in lines:
+        # define signext i8 @add__char__char__char(i8 signext, i8 signext) #0 {
+        l = l.strip()
+        if (l.endswith("{")):
+            ir_function = []
+            m = re.search("@([^(]+)", l)
+            function_name = m.group(1)
+
+        if (ir_function is not None):
+            ir_function.append(l)
+
+        # Note clang puts some debug lines that end in }, only deal with }
+        # if we are inside a function
+        if ((ir_function is not None) and (l.endswith("}"))):
+            ir_functions[function_name] = ir_function
+            function_name = None
+            ir_function = None
     return ir_functions
 
+def load_functions_ir(ir_filepath):
+    with open(ir_filepath, "r") as f:
+        return parse_functions_ir(f)
+
+
+# Binary operator precedence rules whose pass-through alternatives are inlined
+# when loading the grammar. Every expression goes through all the precedence
+# levels, inlining removes the chain of single child nodes from the tree and
+# the generate_ir recursion.
+# The rest of the expression rules are not inlined since generate_ir checks
+# for their node names (eg assignment_expression for array dimensions,
+# expression in for loops, primary_expression and postfix_expression in 
+# postfix_expression) or converts them to IR (cast_expression)
+# See grammar.build_lark_grammar(..., shape_tree=True) for shaping new grammars
+inlined_grammar_rules = [
+    "conditional_expression",
+    "logical_or_expression",
+    "logical_and_expression",
+    "inclusive_or_expression",
+    "exclusive_or_expression",
+    "and_expression",
+    "equality_expression",
+    "relational_expression",
+    "shift_expression",
+    "additive_expression",
+    "multiplicative_expression",
+]
+
+def load_lark_grammar(grammar_filepath):
+    """
+    Return the text of the lark grammar with the inlined_grammar_rules marked
+    with ?
+    """
+    with open(grammar_filepath, "r") as f:
+        grammar_text = f.read()
+    
+    return re.sub(r"^(%s):" % string.join(inlined_grammar_rules, "|"), r"?\1:", 
+        grammar_text, flags=re.MULTILINE)
+
+c99_lexer = None
+
+def get_c99_lexer():
+    """
+    Return the self-hosted C99 lexer, a Struct(token_kinds, scan) where scan is
+    the native scanner function JIT compiled with epycc itself.
+
+    The scanner C code and tables are generated from the C99 lexical grammar
+    DFA (see grammar.build_lexer_tables and grammar.generate_dfa_scanner_c)
+    and stored in the generated dir, they are regenerated when the content
+    hash of the lexical grammar and grammar.py differs from the one stored in
+    the tables, since building the DFA takes a few seconds.
+    """
+    global c99_lexer
+    with init_lock:
+        if (c99_lexer is None):
+            c99_lexer = load_c99_lexer()
+    
+    return c99_lexer
+
+def load_c99_lexer():
+    epycc_dirpath = os.path.dirname(os.path.abspath(__file__))
+    lexical_grammar_filepath = os.path.join(epycc_dirpath, "grammars", "c99_lexical_grammar.txt")
+    tables_filepath = os.path.join(epycc_dirpath, "generated", "c99_lexer_tables.json")
+    c_filepath = os.path.join(epycc_dirpath, "generated", "c99_lexer.c")
+
+    # The generated files depend on the lexical grammar and on the DFA
+    # construction and scanner generation code in grammar.py
+    # Line endings are normalized so the hash is the same on all platforms
+    with open(lexical_grammar_filepath, "rb") as f:
+        source_hash = get_source_hash(
+            (f.read() + inspect.getsource(grammar)).replace("\r\n", "\n"))
+
+    # Regenerate if they don't exist or were generated from different sources
+    tables = None
+    if (os.path.exists(tables_filepath) and os.path.exists(c_filepath)):
+        with open(tables_filepath, "r") as f:
+            tables = Struct(**json.load(f))
+        if (getattr(tables, "source_hash", None) != source_hash):
+            tables = None
+
+    if (tables is None):
+        verbose = grammar.verbose
+        grammar.verbose = False
+        try:
+            tables = grammar.build_lexer_tables(lexical_grammar_filepath, 
+                grammar.c99_lexer_token_kinds)
+        finally:
+            grammar.verbose = verbose
+        tables.source_hash = source_hash
+
+        with open(c_filepath, "w") as f:
+            f.write(grammar.generate_dfa_scanner_c(tables, "c99_scan"))
+        with open(tables_filepath, "w") as f:
+            json.dump(tables.__dict__, f)
+
+    with open(c_filepath, "r") as f:
+        lib = epycc_compile(f.read())
+    cfunc = getattr(lib, "__raw_c99_scan")
+
+    # Create the ctypes tables once, the raw function is called directly to
+    # prevent the marshalling overhead
+    char_classes = (ctypes.c_int * len(tables.char_classes))(*tables.char_classes)
+    transitions = (ctypes.c_int * len(tables.transitions))(*tables.transitions)
+    accepts = (ctypes.c_int * len(tables.accepts))(*tables.accepts)
+    max_tokens = 4096
+
+    def scan(text):
+        """
+        Generator of (token_kind, start, end) for the tokens in text, the
+        token_kind is None for unmatched characters
+        """
+        # Allocate the output buffers per scan so different threads can scan
+        # at the same time
+        token_ends = (ctypes.c_int * max_tokens)()
+        token_kinds = (ctypes.c_int * max_tokens)()
+        source = (ctypes.c_ubyte * len(text)).from_buffer_copy(text)
+        start = 0
+        while (start < len(text)):
+            token_count = cfunc(source, len(text), start, char_classes, 
+                transitions, accepts, token_ends, token_kinds, max_tokens)
+            for i in xrange(token_count):
+                end = token_ends[i]
+                token_kind = token_kinds[i]
+                yield (tables.token_kinds[token_kind] if (token_kind != -1) else None), start, end
+                start = end
+
+    return Struct(token_kinds = tables.token_kinds, scan = scan, lib = lib)
+
+class C99Lexer(lark.lexer.Lexer):
+    """
+    Lark lexer using the self-hosted C99 lexer, see get_c99_lexer
+
+    The C99 lexical grammar token kinds are mapped to the terminals of the
+    lark grammar: keywords and punctuators by their text, integer and floating
+    constants by their prefix. Whitespace and comments are ignored.
+    """
+    def __init__(self, lexer_conf):
+        # lark renamed tokens to terminals in later versions
+        terminals = getattr(lexer_conf, "terminals", None)
+        if (terminals is None):
+            terminals = lexer_conf.tokens
+        self.literal_to_terminal = dict([(terminal.pattern.value, terminal.name) 
+            for terminal in terminals if isinstance(terminal.pattern, lark.lexer.PatternStr)])
+
+    def get_terminal(self, token_kind, value):
+        if ((token_kind == "keyword") or (token_kind == "punctuator")):
+            return self.literal_to_terminal.get(value, None)
+
+        elif (token_kind == "identifier"):
+            # XXX Missing lexer hack to return TYPEDEF_NAME, same as the lark
+            #     lexer
+            return "IDENTIFIER"
+
+        elif (token_kind == "integer-constant"):
+            if (value[:2] in ["0x", "0X"]):
+                return "HEXADECIMAL_CONSTANT"
+            elif (value.startswith("0")):
+                return "OCTAL_CONSTANT"
+            else:
+                return "DECIMAL_CONSTANT"
+
+        elif (token_kind == "floating-constant"):
+            if (value[:2] in ["0x", "0X"]):
+                return "HEXADECIMAL_FLOATING_CONSTANT"
+            else:
+                return "DECIMAL_FLOATING_CONSTANT"
+
+        elif (token_kind == "character-constant"):
+            return "CHARACTER_CONSTANT"
+
+        elif (token_kind == "string-literal"):
+            return "STRING_LITERAL"
+
+        return None
+
+    def lex(self, text, *args):
+        # Newer lark versions pass a lexer state
+        text = getattr(text, "text", text)
+        line = 1
+        line_start = 0
+        for token_kind, start, end in get_c99_lexer().scan(text):
+            value = text[start:end]
+            if ((token_kind != "whitespace") and (token_kind != "comments")):
+                terminal = self.get_terminal(token_kind, value)
+                if (terminal is None):
+                    raise lark.exceptions.UnexpectedCharacters(text, start, line, 
+                        start - line_start + 1)
+                yield lark.Token(terminal, value, start, line, start - line_start + 1)
+            
+            newline_count = value.count("\n")
+            if (newline_count > 0):
+                line += newline_count
+                line_start = start + value.rindex("\n") + 1
+
+class StreamingTransformer(lark.Transformer):
+    """
+    Parse time transformer that generates the IR of each external declaration
+    as soon as the LALR parser reduces it and then drops the subtree, so the
+    tree of the whole translation unit is never built and the peak memory is
+    bounded by the largest function instead of the source size.
+
+    The generator is set before each parse, see epycc_generate
+    """
+    def __init__(self):
+        self.generator = None
+        self.debug = False
+
+    def external_declaration(self, children):
+        tree = lark.Tree("external_declaration", children)
+        if (self.debug):
+            print tree.pretty()
+
+        try:
+            generate_ir(self.generator, tree)
+        except Exception as e:
+            if (hasattr(self.generator, "llvmir") and hasattr(self.generator.llvmir, "function")):
+                print "Generation exception in function\n", str(self.generator.llvmir.function)
+            raise
+
+        # The IR has been generated, don't keep the subtree around
+        return None
+
+    def translation_unit(self, children):
+        # Don't accumulate one node per external declaration either
+        return None
+
+# Parsers and streaming transformers are stateful during the parse, each
+# thread uses its own, see get_thread_parser_state
+thread_parser_states = threading.local()
 
-def epycc_generate(source, debug = False):
+def get_thread_parser_state():
+    """
+    Return the calling thread's Struct(self_hosted_parsers, streaming_transformer)
+    """
+    parser_state = getattr(thread_parser_states, "parser_state", None)
+    if (parser_state is None):
+        parser_state = Struct(
+            # Self-hosted lexer parsers by streaming flag
+            self_hosted_parsers = dict(), 
+            streaming_transformer = StreamingTransformer()
+        )
+        thread_parser_states.parser_state = parser_state
+    
+    return parser_state
+
+def epycc_generate(source, debug = False, instrument = False, profile = None, 
+    self_hosted_lexer = False, streaming = False, arena = False, vla_heap_threshold = None,
+    hoist_vlas = False, declarations = None):
+    """
+    If streaming is True, each external declaration is generated as soon as
+    it's parsed and its subtree freed, see StreamingTransformer. This requires
+    the LALR parser.
+
+    If arena is True, every function takes an arena as hidden last parameter
+    and runtime sized arrays are allocated from it, see Arena
+
+    If vla_heap_threshold is not None, arena is enabled and only runtime sized
+    arrays of at least vla_heap_threshold bytes are allocated from it
+
+    If hoist_vlas is True, runtime sized arrays declared directly in loop bodies
+    before any jump or conditional and with loop invariant dimensions are
+    allocated once before the loop
+
+    If declarations is not None, it's C source with function declarations
+    parsed before the source, the functions declared and not defined are
+    declared in the IR and not exposed in the function signatures
+    """
     # XXX check if we can tag which tokens to keep with "!" in the rule instead 
     #     of keep_all_tokens
 
+    generator = Struct(
+        symbol_table = SymbolTable(), 
+        depth = 0,
+        # Insert execution counters, see generate_counters_ir
+        instrument = instrument,
+        # Allocate runtime sized arrays from the arena, see generate_arena_alloc_ir
+        arena = arena or (vla_heap_threshold is not None),
+        arena_threshold = vla_heap_threshold or 0,
+        # Allocate loop invariant runtime sized arrays before the loop, see
+        # generate_hoisted_vla_ir
+        hoist_vlas = hoist_vlas,
+        llvmir = Struct(
+            module=ir.Module(), 
+            # Basic blocks to branch to in case of break or continue
+            break_bb = None, continue_bb = None, 
+            function=None, externs=dict(),
+            # Register holding the current stacksave value
+            stack_ir_reg = None,
+            # Register holding the arena mark to release at scope end
+            arena_mark_ir_reg = None,
+            # The current function allocates from the arena
+            arena_allocated = False,
+            # String literal globals by contents
+            string_literals = dict(),
+            # Stack of loops being generated, outermost first
+            loops = [],
+            # C line of each basic block of the current function
+            block_lines = dict(),
+        )
+    )
+
     grammar_filepath = os.path.join(os.path.dirname(os.path.abspath(__file__)), 
         "grammars", "c99_phrase_structure_grammar.lark")
     use_earley = False
+    assert not (use_earley and streaming), "Streaming requires the LALR parser"
     if (use_earley):
         # Use the standard lexer since the earley parser dynamic lexer confuses return
         # token with an identifier when a parenthesis follows, eg
@@ -2854,7 +4770,7 @@ def epycc_generate(source, debug = False):
         
         # Note that Earley is 10x slower than LALR with file caching, and causes
         # stack overflow with long C files (thousands of lines).
-        parser = lark.Lark.open(grammar_filepath, keep_all_tokens="True", 
+        parser = lark.Lark(load_lark_grammar(grammar_filepath), keep_all_tokens="True", 
             lexer="standard")
 
     else:
@@ -2869,44 +4785,63 @@ def epycc_generate(source, debug = False):
         # Note LALR works with both the standard and context lexers, but is not
         # able to solve the C99 typedef_name / identifier ambiguity, it just picks
         # identifier over typedef_name
-        parser = lark.Lark.open(grammar_filepath, keep_all_tokens="True", 
-            lexer="standard", parser="lalr", cache=True)
+        # In streaming mode the LALR parser invokes the transformer callbacks
+        # as rules are reduced, see StreamingTransformer (the transformer is
+        # not part of the lark cache key, so caching still works)
+        parser_state = get_thread_parser_state()
+        streaming_transformer = parser_state.streaming_transformer
+        self_hosted_parsers = parser_state.self_hosted_parsers
+        transformer = streaming_transformer if (streaming) else None
+        if (self_hosted_lexer):
+            # Use the native lexer JIT compiled by epycc, see C99Lexer. Lark
+            # can't cache grammars with custom lexers, cache the parser instead
+            if (streaming not in self_hosted_parsers):
+                self_hosted_parsers[streaming] = lark.Lark(load_lark_grammar(grammar_filepath), 
+                    keep_all_tokens="True", lexer=C99Lexer, parser="lalr", 
+                    transformer=transformer)
+            parser = self_hosted_parsers[streaming]
 
-    tree = parser.parse(source)
+        else:
+            parser = lark.Lark(load_lark_grammar(grammar_filepath), keep_all_tokens="True", 
+                lexer="standard", parser="lalr", cache=True, transformer=transformer)
 
-    if (debug):
-        print tree.pretty()
+    sources = [source]
+    if (declarations is not None):
+        sources.insert(0, declarations)
 
-    generator = Struct(
-        symbol_table = SymbolTable(), 
-        depth = 0,
-        llvmir = Struct(
-            module=ir.Module(), 
-            # Basic blocks to branch to in case of break or continue
-            break_bb = None, continue_bb = None, 
-            function=None, externs=dict(),
-            # Register holding the current stacksave value
-            stack_ir_reg = None,
-        )
-    )
+    if (streaming):
+        streaming_transformer.generator = generator
+        streaming_transformer.debug = debug
+        try:
+            for source_text in sources:
+                parser.parse(source_text)
+        finally:
+            streaming_transformer.generator = None
 
-    try:    
-        generate_ir(generator, tree)
-    except Exception as e:
-        if (hasattr(generator, "llvmir") and hasattr(generator.llvmir, "function")):
-            print "Generation exception in function\n", str(generator.llvmir.function)
-        raise
+    else:
+        for source_text in sources:
+            tree = parser.parse(source_text)
+
+            if (debug):
+                print tree.pretty()
+
+            try:    
+                generate_ir(generator, tree)
+            except Exception as e:
+                if (hasattr(generator, "llvmir") and hasattr(generator.llvmir, "function")):
+                    print "Generation exception in function\n", str(generator.llvmir.function)
+                raise
+
+    if (profile is not None):
+        if (profile["source_hash"] != get_source_hash(source)):
+            print "Warning: ignoring profile collected from a different source"
+        else:
+            generate_profile_ir(generator, profile)
 
-    epycc_dirpath = os.path.dirname(os.path.abspath(__file__))
-    generated_c_filepath = os.path.join(epycc_dirpath, "generated", "irs.c")
-    generated_ir_filepath = os.path.join(epycc_dirpath, "generated", "irs.ll")
+    if (instrument):
+        generate_counters_ir(generator)
 
-    # Regenerate if they don't exist or same or older than this python file
-    if (not os.path.exists(generated_ir_filepath) or
-        (os.path.getmtime(generated_ir_filepath) <= os.path.getmtime(__file__))):
-        precompile_c_snippets(generated_c_filepath, generated_ir_filepath)
-    
-    all_externs = load_functions_ir(generated_ir_filepath)
+    all_externs = get_c_snippets_ir()
     
     llvm_irs = []
     function_signatures = []
@@ -2914,17 +4849,46 @@ def epycc_generate(source, debug = False):
     assert len(generator.symbol_table) == 1, "Symbol table is not at global scope!!!"
     # Collect function signatures in ctypes format
     for sym in generator.symbol_table.values():
-        if (sym.type == "function"):
+        if ((sym.type == "function") and (not hasattr(sym, "llvm_irs"))):
+            # Declared but not defined, defined in a linked library
+            llvm_irs.append(str(sym.ir))
+            llvm_irs.append("")
+
+        elif (sym.type == "function"):
 
             llvm_irs.extend(sym.llvm_irs)
+            if (hasattr(sym, "entry_count_md")):
+                # llvmlite has no function metadata attachments, append to the
+                # define line (the function's opening brace is in the next
+                # line)
+                llvm_irs[-len(sym.llvm_irs)] += " !prof %s" % sym.entry_count_md.get_reference()
             llvm_irs.append("")
             llvm_irs.append("")
 
             function_signature = Struct(
                 name=sym.name, 
-                ctypes = [get_ctype(sym.value_type)] + 
-                    [get_ctype(parameter.value_type) for parameter in sym.parameters]
+                ctypes = [get_ctype(sym.value_type)],
+                # Per parameter None or (number of dimensions, item ctype) of
+                # strided arrays, see epyccrt.strided_wrapper
+                strided = [],
+                counters = getattr(sym, "counters", []),
+                arena = generator.arena,
+                prototype = sym.prototype
             )
+            for parameter in sym.parameters:
+                function_signature.ctypes.append(get_ctype(parameter.value_type))
+                if (type_is_strided_array(parameter.value_type)):
+                    # The hidden byte strides
+                    ndims = len(get_array_dims(parameter.value_type))
+                    function_signature.ctypes.extend([ctypes.c_int64] * ndims)
+                    function_signature.strided.append(
+                        (ndims, get_ctype(get_array_item_type(parameter.value_type))))
+
+                else:
+                    function_signature.strided.append(None)
+            if (generator.arena):
+                # The hidden arena parameter
+                function_signature.ctypes.append(ctypes.c_void_p)
 
             function_signatures.append(function_signature)
     
@@ -2941,6 +4905,20 @@ def epycc_generate(source, debug = False):
         if (module_global.startswith("llvm.")):
             llvm_irs.append(str(generator.llvmir.module.globals[module_global]))
 
+    # Dump the global variables (function globals are dumped above)
+    llvm_irs.append("; Global variables")
+    for module_global in generator.llvmir.module.globals.values():
+        if (isinstance(module_global, ir.GlobalVariable)):
+            llvm_irs.append(str(module_global))
+
+    # Dump the metadata, referenced by the profile annotations
+    llvm_irs.append("; Metadata")
+    for metadata in generator.llvmir.module.metadata:
+        llvm_irs.append(str(metadata))
+    for name, named_metadata in generator.llvmir.module.namedmetadata.items():
+        llvm_irs.append("!%s = !{ %s }" % (name,
+            string.join([operand.get_reference() for operand in named_metadata.operands], ", ")))
+
 
 
     for function_extern in function_externs:
@@ -2957,17 +4935,214 @@ def epycc_generate(source, debug = False):
     return llvm_ir, function_signatures
 
 
-def epycc_compile(source, debug = False):
+def epycc_compile(source, debug = False, instrument = False, profile = None, latency = False,
+    self_hosted_lexer = False, streaming = False, arena = False, vla_heap_threshold = None,
+    hoist_vlas = False, libs = None):
+    """
+    Compile the C source and return a jit_lib with one Python callable per C
+    function.
+
+    If instrument is True, every function and basic block increments an
+    execution counter, the counters are exposed as jit_lib.counters (numpy
+    array if numpy is available) and jit_lib.counter_info maps each counter to
+    the function, basic block and C line.
+
+    If profile is not None, the code is optimized using the execution counts
+    in the profile, see JitLib.get_profile and JitLib.reoptimize_with_profile
+
+    If latency is True, every call records the time spent converting the
+    arguments, in the C function and copying back the arguments into a
+    LatencyHistogram exposed as jit_lib.<function>.latency
+
+    If self_hosted_lexer is True, the source is tokenized with the C99 lexer
+    compiled by epycc itself instead of the lark lexer, see C99Lexer
+
+    If streaming is True, the IR of each function is generated as soon as it's
+    parsed instead of after parsing the whole source, see StreamingTransformer
+
+    If arena is True, runtime sized arrays are allocated from an Arena instead
+    of the stack. The functions use the arena in jit_lib.arena or a per-thread
+    arena if None. The __raw_ functions take the arena address as additional
+    last parameter (None allocates in the stack)
+
+    If vla_heap_threshold is not None, runtime sized arrays smaller than
+    vla_heap_threshold bytes are allocated in the stack and the rest in the
+    arena, arena is implicitly enabled
+
+    If hoist_vlas is True, runtime sized arrays declared directly in loop bodies
+    before any jump or conditional and with loop invariant dimensions are
+    allocated once before the loop instead of on every iteration. This is not the default because clang doesn't do it and
+    the generated IR is compared against clang's
+
+    If libs is not None, it's a list of libraries returned by epycc_compile
+    whose functions can be called from the source without declaring them.
+    Their IR is linked into the library before optimizing, so the calls are
+    native and can be inlined. The libraries must have been compiled with the
+    same arena setting
+    """
     # XXX This does reinitialization when called multiple times and causes 
     #     warnings like 
     #       :for the -x86-asm-syntax option: may only occur zero or one times!
     #     Do proper tear down or return some kind of singleton
 
-    llvm_ir, function_signatures = epycc_generate(source, debug)
-    lib = llvm_compile(llvm_ir, function_signatures)
+    declarations = None
+    if (libs is not None):
+        uses_arena = arena or (vla_heap_threshold is not None)
+        prototypes = []
+        for linked_lib in libs:
+            for function_signature in linked_lib.function_signatures:
+                assert function_signature.arena == uses_arena, \
+                    "Can't link %s, compiled with a different arena setting" % function_signature.name
+                prototypes.append(function_signature.prototype)
+        declarations = string.join(prototypes, "\n")
+
+    llvm_ir, function_signatures = epycc_generate(source, debug, instrument, profile, 
+        self_hosted_lexer, streaming, arena, vla_heap_threshold, hoist_vlas, declarations)
+    lib = llvm_compile(llvm_ir, function_signatures, latency, libs)
+    lib.source = source
+    lib.libs = libs
+    # Options this library was compiled with other than libs, needed to key
+    # the libraries that link it, see get_libs_key
+    lib.options = dict(debug=debug, instrument=instrument, profile=profile, latency=latency,
+        self_hosted_lexer=self_hosted_lexer, streaming=streaming, arena=arena, 
+        vla_heap_threshold=vla_heap_threshold, hoist_vlas=hoist_vlas)
+    # Options that change the generated code, needed to recompile
+    lib.codegen_options = dict(arena=arena, vla_heap_threshold=vla_heap_threshold, 
+        hoist_vlas=hoist_vlas)
 
     return lib
 
+def compile_async_worker(source, options):
+    lib = epycc_compile(source, **options)
+    # Send the library back as object code, see JitLib.__getstate__
+    pickled_lib = cPickle.dumps(lib, cPickle.HIGHEST_PROTOCOL)
+    lib.close()
+
+    return pickled_lib
+
+class CompileFuture:
+    """
+    Result of compile_async
+    """
+    def __init__(self, async_result):
+        self.async_result = async_result
+        self.lock = threading.Lock()
+        self.lib = None
+
+    def done(self):
+        return self.async_result.ready()
+
+    def result(self, timeout = None):
+        """
+        Return the compiled library, waiting at most timeout seconds for the
+        compilation to finish (raises multiprocessing.TimeoutError), or
+        forever if None. Raises the compilation exception if it failed
+        """
+        with self.lock:
+            if (self.lib is None):
+                pickled_lib = self.async_result.get(timeout)
+                self.lib = cPickle.loads(pickled_lib)
+
+        return self.lib
+
+# Process pool used by compile_async, see get_compile_pool
+compile_pool = None
+compile_pool_processes = None
+
+def get_compile_pool():
+    global compile_pool
+    # Create the pool with the init lock held so the lock is not held by some
+    # other thread when forking the workers, which would deadlock them
+    with init_lock:
+        if (compile_pool is None):
+            compile_pool = multiprocessing.Pool(compile_pool_processes)
+
+    return compile_pool
+
+def compile_async(source, **options):
+    """
+    Compile the source in the background and return a CompileFuture for the
+    library, the options are the same as epycc_compile's.
+
+    The compilation runs in a pool of compile_pool_processes worker processes
+    (the number of CPUs if None) so parsing and code generation don't hold
+    this process' GIL, the library comes back as object code and only needs
+    loading, see llvm_load.
+
+    libs is not supported, linked libraries can't be sent to the workers
+    """
+    if (options.get("libs", None) is not None):
+        raise ValueError("compile_async doesn't support libs, use epycc_compile")
+    return CompileFuture(get_compile_pool().apply_async(compile_async_worker, (source, options)))
+
+def close_compile_pool():
+    """
+    Terminate the compile_async worker processes, they are created again on
+    the next compile_async
+    """
+    global compile_pool
+    with init_lock:
+        if (compile_pool is not None):
+            compile_pool.terminate()
+            compile_pool.join()
+            compile_pool = None
+
+def epycc_build(source, filepath, module_name = None, hoist_vlas = False):
+    """
+    Compile the C source into the CPython extension module filepath, with one
+    Python function per C function, see generate_extension_c.
+
+    Unlike the libraries returned by epycc_compile, importing the extension
+    requires no compilation and calls don't go through ctypes.
+
+    The module name defaults to the filepath's basename up to the first dot
+    """
+    if (module_name is None):
+        module_name = os.path.basename(filepath).split(".")[0]
+    
+    llvm_ir, function_signatures = epycc_generate(source, hoist_vlas = hoist_vlas)
+
+    llvm_initialize()
+    mod = llvm.parse_assembly(llvm_ir)
+    mod.verify()
+    pmb = create_pass_manager_builder()
+    pm = llvm.create_module_pass_manager()
+    pmb.populate(pm)
+    pm.run(mod)
+
+    import distutils.sysconfig
+    c_filepath = filepath + ".c"
+    with open(c_filepath, "w") as f:
+        f.write(generate_extension_c(module_name, function_signatures))
+    try:
+        link_shared_object(mod, filepath, [c_filepath], 
+            ["-I" + distutils.sysconfig.get_python_inc()])
+    finally:
+        os.remove(c_filepath)
+
+def epycc_main(argv):
+    """
+    Command line entry point, eg
+        epycc.py build kernels.c -o kernels_ext.so
+    """
+    import argparse
+    parser = argparse.ArgumentParser(prog="epycc.py", description="Embedded Python C Compiler")
+    subparsers = parser.add_subparsers(dest="command")
+    build_parser = subparsers.add_parser("build", 
+        help="build a CPython extension module from a C file")
+    build_parser.add_argument("c_filepath", help="C source file")
+    build_parser.add_argument("-o", dest="filepath", required=True, 
+        help="extension module file, eg kernels_ext.so")
+    build_parser.add_argument("--module-name", default=None, 
+        help="module name, defaults to the extension file's basename")
+    build_parser.add_argument("--hoist-vlas", action="store_true", 
+        help="hoist loop invariant runtime sized arrays out of loops")
+    args = parser.parse_args(argv)
+
+    if (args.command == "build"):
+        with open(args.c_filepath, "r") as f:
+            source = f.read()
+        epycc_build(source, args.filepath, args.module_name, args.hoist_vlas)
 
 
 def llvm_ir_diff(filepath_a, filepath_b, function_names = None):
@@ -3049,19 +5224,130 @@ def llvm_ir_diff(filepath_a, filepath_b, function_names = None):
             case not when comparing against default naming file? (because default
             naming guarantees montonically increasing registers so any remapping 
             would also guarantee it?)
+
+    Functions are first compared by signature, the hash of each block's
+    canonicalized instructions (see get_function_signature). Functions with
+    the same signature are equal modulo a renaming of values and labels, which
+    is taken from the signature without walking the blocks, so the common
+    case of matching functions is linear in the function size.
+
+    Functions with different signatures go through the remapping walk, which
+    is kept near-linear in the function size: functions and blocks are looked
+    up through dicts built once per function (label operands stringify to the
+    full block text, so blocks are indexed by their text), each instruction is
+    stringified and tokenized once and the tokens that can't be remapped are
+    precomputed for the early mismatch check. Blocks are only walked more than
+    once when their phi operands can't be remapped yet.
             
     """
 
-    def search_block(block_str, blocks):
-        block = block_str_to_block.get(block_str, None)
-        if (block is None):
-            for block in blocks:
-                if (block_str == str(block)):
-                    block_str_to_block[block_str] = block
-                    break
-                
-        return block
+    def get_block_records(block, block_records, block_by_str):
+        """
+        Return the list of canonicalized instructions of the block as
+        Struct(instr, opcode, text, tokens, cmp_tokens, nonreg_tokens, labels)
+
+        Blocks are visited multiple times (eg when revisiting for phi
+        remapping) and instructions are compared and sorted multiple times,
+        so the string conversion and tokenization of each instruction is
+        done only once and cached
+        """
+        records = block_records.get(block, None)
+        if (records is None):
+            records = []
+            for instr in block.instructions:
+                text = str(instr).strip()
+                # Note some operations (eg switch) include carriage returns,
+                # remove those too
+                tokens = re.split(r"[ ,\n]+", text)
+
+                # epycc doesn't fill Type Based Alias Analysis info, remove
+                # those tokens
+                #   store i32 0, i32* %13, align 4, !tbaa !3
+                # XXX See if epycc needs to support TBAA?
+                if ("!tbaa" in tokens):
+                    tokens = tokens[:tokens.index("!tbaa")]
+
+                # instr.opcode is a string with the opcode, but has
+                # information missing, eg "icmp" for "icmp gte" 
+
+                # str(operand) returns type and name, but name is empty for
+                # auto-gen for labels, the str() gives the full basic block
+                # the label points to, find the block from that
+                labels = []
+                for operand in instr.operands:
+                    label = None
+                    if (str(operand.type) == "label"):
+                        label = block_by_str.get(str(operand), None)
+                        assert(label is not None)
+                    labels.append(label)
+
+                records.append(Struct(
+                    instr = instr,
+                    opcode = instr.opcode,
+                    text = text,
+                    tokens = tokens,
+                    cmp_tokens = re.split(r"[ ,]+", text),
+                    # Tokens that cannot be remapped
+                    nonreg_tokens = [(i, token) for i, token in enumerate(tokens) if not token.startswith("%")],
+                    labels = labels
+                ))
+            block_records[block] = records
+
+        return records
         
+    def get_block_label(block, block_str, default_label):
+        """
+        Return the label of the block, default names don't appear in
+        block.name but in the first line of the block text, eg "; <label>:4:"
+        or "4:"
+        """
+        if (block.name != ""):
+            return "%%%s" % block.name
+
+        m = re.match(r"\s*(?:; <label>:(\d+)|(\d+)):", block_str)
+        if (m is not None):
+            return "%%%s" % (m.group(1) or m.group(2))
+
+        return default_label
+
+    def get_function_signature(fn, blocks, block_records, block_by_str):
+        """
+        Return the signature of the function and its names in order of first
+        appearance.
+
+        The signature is the tuple of block signatures, each one the hash of
+        the block label and instruction tokens with the names (%...) replaced
+        by their order of first appearance in the function. Two functions with
+        the same signature are equal modulo a renaming of values and labels,
+        given by zipping their names in order of first appearance.
+        """
+        names = dict()
+        ordered_names = []
+        def canonicalize(token):
+            if (not token.startswith("%")):
+                return token
+            index = names.get(token, None)
+            if (index is None):
+                index = len(ordered_names)
+                names[token] = index
+                ordered_names.append(token)
+            return "%%%d" % index
+
+        # Arguments first, with the same naming as the remapping table
+        arguments = list(fn.arguments)
+        for i, argument in enumerate(arguments):
+            canonicalize("%%%s" % argument.name if (argument.name != "") else "%%%d" % i)
+
+        block_strs = dict([(block, block_str) for block_str, block in block_by_str.iteritems()])
+        signature = []
+        for block in blocks:
+            tokens = [canonicalize(get_block_label(block, block_strs[block], "%%%d" % len(arguments)))]
+            for record in get_block_records(block, block_records, block_by_str):
+                tokens.extend([canonicalize(token) for token in record.tokens])
+            signature.append(hash(tuple(tokens)))
+
+        return tuple(signature), ordered_names
+
     def sort_phi_operands(tokens, remap_sort, remap_result):
         # XXX This accesses the remapping table, should be passed as param?
         phi_operands = [ tokens[4+i*4:4+(i+1)*4] for i in (xrange((len(tokens) - 4) / 4)) ]
@@ -3095,10 +5381,6 @@ def llvm_ir_diff(filepath_a, filepath_b, function_names = None):
 
             i0_i, instr0 = i0
             i1_i, instr1 = i1
-            str_instr0 = str(instr0).strip()
-            str_instr1 = str(instr1).strip()
-            tokens0 = re.split(r"[ ,]+", str_instr0)
-            tokens1 = re.split(r"[ ,]+", str_instr1)
             
             res = 0
             
@@ -3106,6 +5388,8 @@ def llvm_ir_diff(filepath_a, filepath_b, function_names = None):
             # unremapped phis (note in all a instructions are considered
             # remapped)
             if ((instr0.opcode == "phi") and (instr1.opcode == "phi")):
+                tokens0 = instr0.cmp_tokens
+                tokens1 = instr1.cmp_tokens
                 lacks_remappings0 = lacks_remappings1 = False
                 if (remap):
                     lacks_remappings0 = any([token not in remapping_table for token in tokens0])
@@ -3147,6 +5431,10 @@ def llvm_ir_diff(filepath_a, filepath_b, function_names = None):
 
             return res
 
+        # Only blocks with phis need sorting
+        if (not any([instr.opcode == "phi" for instr in instructions])):
+            return list(instructions)
+
         index_instructions = [ (i, item) for i, item in enumerate(instructions)]
         instructions_sorted = [item for i, item in sorted(index_instructions, cmp=cmp_instructions)]
         
@@ -3167,24 +5455,28 @@ def llvm_ir_diff(filepath_a, filepath_b, function_names = None):
     mod_a = llvm.parse_assembly(llvm_ir_a)
     mod_b = llvm.parse_assembly(llvm_ir_b)
 
-    fns_a = {}
-    fns_b = {}
+    # Index the functions in b by name
+    fns_b = dict([(fn_b.name, fn_b) for fn_b in mod_b.functions])
     
     if (function_names is not None):
         if (isinstance(function_names, str)):
             function_names = [function_names]
         function_names = set(function_names)
 
+    # Placeholder record used when a block has less instructions than the
+    # other, it will be detected as a mismatch because of different token
+    # lengths
+    empty_record = Struct(instr = "", opcode = None, text = "", tokens = [""],
+        cmp_tokens = [""], nonreg_tokens = [(0, "")], labels = [])
+
     for fn_a in mod_a.functions:
         if ((function_names is not None) and (fn_a.name not in function_names)):
             continue
 
         # look for the function in b, note it's intentional this will ignore
         # and not return as diffs the functions in b not present in a
-        for fn_b in mod_b.functions:
-            if (fn_a.name == fn_b.name):
-                break
-        else:
+        fn_b = fns_b.get(fn_a.name, None)
+        if (fn_b is None):
             # fn_a doesn't exist in b, add each instruction to the mismatch
             # XXX Note this will contain comments and the function header, which
             #     won't appear on a regular per block diff where both a and
@@ -3192,8 +5484,11 @@ def llvm_ir_diff(filepath_a, filepath_b, function_names = None):
             mismatches[fn_a.name] = [instr for instr in str(fn_a).splitlines()]
             continue
 
+        blocks_a = list(fn_a.blocks)
+        blocks_b = list(fn_b.blocks)
+
         # Ignore functions with no blocks (declarations)
-        if ((len(list(fn_a.blocks)) == 0) or (len(list(fn_b.blocks)) == 0)):
+        if ((len(blocks_a) == 0) or (len(blocks_b) == 0)):
             continue
             
         function_mismatch_count = 0
@@ -3201,58 +5496,79 @@ def llvm_ir_diff(filepath_a, filepath_b, function_names = None):
         side_by_sides[fn_a.name] = set()
 
         # Get the entry blocks
-        block_a = list(fn_a.blocks)[0]
-        block_b = list(fn_b.blocks)[0]
+        block_a = blocks_a[0]
+        block_b = blocks_b[0]
+
+        arguments_a = list(fn_a.arguments)
+        arguments_b = list(fn_b.arguments)
 
         # XXX Should this abort if the number of arguments or the return type 
         #     is already different?
-        assert(len(list(fn_a.arguments)) == len(list(fn_b.arguments)))
+        assert(len(arguments_a) == len(arguments_b))
         
         # Add the function arguments to the remapping table
         remapping_table = {
             "%%%s" % argument_b.name if (argument_b.name != "") else "%%%d" % i :
             "%%%s" % argument_a.name if (argument_a.name != "") else "%%%d" % i 
-                for i, (argument_a, argument_b) in enumerate(zip(fn_a.arguments, fn_b.arguments))
+                for i, (argument_a, argument_b) in enumerate(zip(arguments_a, arguments_b))
         }
         
         # Add the initial block to the remapping table, this may appear in 
         # labels but not in a label declaration if the IR uses default naming
-        block_name_a = block_a.name if (block_a.name != "") else "%%%d" % len(list(fn_a.arguments))
-        block_name_b = block_b.name if (block_b.name != "") else "%%%d" % len(list(fn_a.arguments))
+        block_name_a = block_a.name if (block_a.name != "") else "%%%d" % len(arguments_a)
+        block_name_b = block_b.name if (block_b.name != "") else "%%%d" % len(arguments_a)
         remapping_table["%%%s" % block_name_b] = block_name_a
 
-        # Block cache for searches
-        block_str_to_block = dict()
+        # Label operands stringify to the full text of the block they point
+        # to, index the blocks by their text so they can be found in constant
+        # time
+        block_by_str_a = dict([(str(block), block) for block in blocks_a])
+        block_by_str_b = dict([(str(block), block) for block in blocks_b])
+        block_records_a = dict()
+        block_records_b = dict()
+
+        signature_a, names_a = get_function_signature(fn_a, blocks_a, block_records_a, block_by_str_a)
+        signature_b, names_b = get_function_signature(fn_b, blocks_b, block_records_b, block_by_str_b)
+        if (signature_a == signature_b):
+            # Equal modulo renaming, take the remapping from the signatures
+            # and skip the walk
+            remapping_table.update(zip(names_b, names_a))
+            side_by_sides[fn_a.name] = set(zip(blocks_a, blocks_b))
+            pending_block_pairs_queue = collections.deque()
 
-        pending_block_pairs_queue = [(block_a, block_b)]
+        else:
+            pending_block_pairs_queue = collections.deque([(block_a, block_b)])
         pending_block_pairs = set(pending_block_pairs_queue)
         done_block_pairs = set()
         remapping_table_length_at_enqueue_time = {}
         while (len(pending_block_pairs_queue) > 0):
-            block_pair = pending_block_pairs_queue.pop(0)
+            block_pair = pending_block_pairs_queue.popleft()
             pending_block_pairs.remove(block_pair)
             debug_queue = False
             if (debug_queue):
                 print "popped", [hash(b) for b in block_pair],
                 print [(hash(ba), hash(bb)) for ba, bb in pending_block_pairs_queue]
 
-            original_pending_block_pairs_queue = tuple(pending_block_pairs_queue)
             original_remapping_table_length = len(remapping_table)
+            # Block pairs queued while visiting this pair, used to recover the
+            # composition of the queue at pop time if this pair needs to be
+            # revisited
+            queued_block_pairs = set()
 
             table_length_queue = remapping_table_length_at_enqueue_time.get(block_pair, None)
             can_revisit = True
             if (table_length_queue is not None):
                 if (
                     (table_length_queue.remapping_table_length == len(remapping_table)) and
-                    (set(table_length_queue.pending_block_pairs_queue) == set(tuple(pending_block_pairs_queue)))
+                    (table_length_queue.pending_block_pairs == pending_block_pairs)
                 ):
                     can_revisit = False
                 # No need to keep this around unless revisiting again
                 #del remapping_table_length_at_enqueue_time[block_pair]
             
             block_a, block_b = block_pair
-            instructions_a = block_a.instructions
-            instructions_b = block_b.instructions
+            instructions_a = get_block_records(block_a, block_records_a, block_by_str_a)
+            instructions_b = get_block_records(block_b, block_records_b, block_by_str_b)
 
             side_by_sides[fn_a.name].add(block_pair)
 
@@ -3264,33 +5580,21 @@ def llvm_ir_diff(filepath_a, filepath_b, function_names = None):
 
             debug_instruction_sorting = False
             if (debug_instruction_sorting):
-                print "a sorted\n", string.join([str(instr) for instr in instructions_sorted_a], "\n")
-                print "b sorted\n", string.join([str(instr) for instr in instructions_sorted_b], "\n")
+                print "a sorted\n", string.join([instr.text for instr in instructions_sorted_a], "\n")
+                print "b sorted\n", string.join([instr.text for instr in instructions_sorted_b], "\n")
 
             needs_revisiting = False
             # If blocks have different number of instructions, fill with empty
-            # strings so they are detected as mismatches (will be detected as a
+            # records so they are detected as mismatches (will be detected as a
             # mismatch because of different token lengths)
             delta_len_a_b = len(instructions_sorted_a) - len(instructions_sorted_b)
-            instructions_sorted_b.extend([""] * (max(delta_len_a_b, 0)))
-            instructions_sorted_a.extend([""] * (max(-delta_len_a_b, 0)))
+            instructions_sorted_b.extend([empty_record] * (max(delta_len_a_b, 0)))
+            instructions_sorted_a.extend([empty_record] * (max(-delta_len_a_b, 0)))
             for instr_a, instr_b in zip(instructions_sorted_a, instructions_sorted_b):
-                str_instr_a = str(instr_a).strip()
-                str_instr_b = str(instr_b).strip()
-                # Note some operations (eg switch) include carriage returns,
-                # remove those too
-                tokens_a = re.split(r"[ ,\n]+", str_instr_a)
-                tokens_b = re.split(r"[ ,\n]+", str_instr_b)
-
-                # epycc doesn't fill Type Based Alias Analysis info, remove
-                # those tokens
-                #   store i32 0, i32* %13, align 4, !tbaa !3
-                # XXX See if epycc needs to support TBAA?
-                if ("!tbaa" in tokens_a):
-                    tokens_a = tokens_a[:tokens_a.index("!tbaa")]
-
-                if ("!tbaa" in tokens_b):
-                    tokens_b = tokens_b[:tokens_b.index("!tbaa")]
+                str_instr_a = instr_a.text
+                str_instr_b = instr_b.text
+                tokens_a = instr_a.tokens
+                tokens_b = instr_b.tokens
 
                 # If the instruction has different lengths, or opcodes, or
                 # non-register tokens that cannot be rearranged, no remapping
@@ -3298,15 +5602,15 @@ def llvm_ir_diff(filepath_a, filepath_b, function_names = None):
                 mismatch_found = False
                 if ((len(tokens_a) != len(tokens_b)) or 
                     (instr_a.opcode != instr_b.opcode) or 
-                    ((instr_a.opcode != "phi") and any([token_a != token_b 
-                        for token_a, token_b in zip(tokens_a, tokens_b) if not token_b.startswith("%")]))):
+                    ((instr_a.opcode != "phi") and any([tokens_a[i] != token_b 
+                        for i, token_b in instr_b.nonreg_tokens]))):
 
                     mismatch_found = True
 
                 else:
                     # Try to remap registers to make instructions match
 
-                    remapping_table.update({token_b : token_b for token_b in tokens_b if token_b[0] != "%"})
+                    remapping_table.update({token_b : token_b for i, token_b in instr_b.nonreg_tokens})
 
                     # Phi instructions 
                     #   %indvars.iv10 = phi i32 [ %indvars.iv.next11, %forend.1 ], [ -4, %entry ]
@@ -3358,53 +5662,42 @@ def llvm_ir_diff(filepath_a, filepath_b, function_names = None):
                 # If the instruction is the empty string, it means one of the
                 # blocks has less instructions, so even if the other instruction
                 # contained labels, we wouldn't know what block to pair it with,
-                # so don't bother queueing any blokcs in that case 
+                # so don't bother queueing any blokcs in that case (empty
+                # records have no labels)
                 # XXX Ideally we would add that whole block as mismatches, but
                 #     we may match that block in another way, so we cannot
                 #     naively do it
-                if (isinstance(instr_a, llvm.ValueRef) and isinstance(instr_b, llvm.ValueRef)):
-                    for operand_a, operand_b in zip(instr_a.operands, instr_b.operands):
-                        # instr.opcode is a string with the opcode, but has
-                        # information missing, eg "icmp" for "icmp gte" 
-
-                        # str(operand) returns type and name, but name is empty for
-                        # auto-gen for labels, the str() gives the full basic block
-                        # the label points to, do a full text search for that block
-                        # and add it to the queue
-
-                        if (str(operand_a.type) == "label"):
-                            # Find the block by string search
-                            next_block_a = search_block(str(operand_a), fn_a.blocks)
-                            next_block_b = search_block(str(operand_b), fn_b.blocks)
-                            
-                            assert(next_block_a is not None)
-                            assert(next_block_b is not None)
-                            
-                            next_block_pair = (next_block_a, next_block_b)
-                            if ((next_block_pair not in done_block_pairs) and 
-                                (next_block_pair not in pending_block_pairs) and 
-                                (next_block_pair != block_pair)
-                               ):
-                                
-                                pending_block_pairs_queue.append(next_block_pair)
-                                pending_block_pairs.add(next_block_pair)
-                                if (debug_queue):
-                                    print "queued", [hash(b) for b in next_block_pair],
-                                    print [(hash(ba), hash(bb)) for ba, bb in pending_block_pairs_queue]
+                for next_block_a, next_block_b in zip(instr_a.labels, instr_b.labels):
+                    if (next_block_a is None):
+                        continue
+                    assert(next_block_b is not None)
+                    
+                    next_block_pair = (next_block_a, next_block_b)
+                    if ((next_block_pair not in done_block_pairs) and 
+                        (next_block_pair not in pending_block_pairs) and 
+                        (next_block_pair != block_pair)
+                       ):
+                        
+                        pending_block_pairs_queue.append(next_block_pair)
+                        pending_block_pairs.add(next_block_pair)
+                        queued_block_pairs.add(next_block_pair)
+                        if (debug_queue):
+                            print "queued", [hash(b) for b in next_block_pair],
+                            print [(hash(ba), hash(bb)) for ba, bb in pending_block_pairs_queue]
 
             # Re-enqueue if this block needs revisiting, 
             if (needs_revisiting):
                 # This block shouldn't be in the pending pairs
                 assert(block_pair not in pending_block_pairs)
-                # Record the remapping table length and the queue composition,
-                # if the next time this pair is popped both are the same, don't
-                # allow revisiting. This prevents infinite loops when some
-                # operands can never be remapped.
+                # Record the remapping table length and the queue composition
+                # at pop time, if the next time this pair is popped both are the
+                # same, don't allow revisiting. This prevents infinite loops
+                # when some operands can never be remapped.
                 # XXX There's probably something simpler than the whole queue
                 #     and the remapping table length we can tag on?
                 remapping_table_length_at_enqueue_time[block_pair] = Struct(
                     remapping_table_length = original_remapping_table_length,
-                    pending_block_pairs_queue = original_pending_block_pairs_queue
+                    pending_block_pairs = pending_block_pairs - queued_block_pairs
                 )
                 
                 # XXX This could remove the completely remapped instructions
@@ -3425,10 +5718,11 @@ def llvm_ir_diff(filepath_a, filepath_b, function_names = None):
         fn_a_unremapped = []
         # convert to list to preserve order before adding function headers, 
         # the header will be remapped below with the blocks
+        fn_a_header = str(fn_a).splitlines()[2]
         side_by_sides[fn_a.name] = list(side_by_sides[fn_a.name])
         side_by_sides[fn_a.name].insert(0, [
-            str(fn_a).splitlines()[2],
-            str(fn_a).splitlines()[2]
+            fn_a_header,
+            fn_a_header
         ])
         # Traverse headers + both blocks in the same order for easy text
         # diffing, remap one
@@ -3474,6 +5768,13 @@ def generate_dot(llvm_ir_filepath):
             invoke_dot(dot_filepath)
 
 if (__name__ == "__main__"):
+
+    if (len(sys.argv) > 1):
+        # Run the command line from the imported module, since running as
+        # __main__ enables the debug output
+        import epycc
+        epycc.epycc_main(sys.argv[1:])
+        sys.exit()
     
     if (False):
         # Direct diff tests
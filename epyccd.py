@@ -0,0 +1,315 @@
+#!/usr/bin/env python
+"""
+epyccd - epycc compile server
+
+Copyright (C) 2021 Antonio Tejada
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+Local compile daemon shared by the processes of a host, so the parser,
+snippets IR and LLVM state are kept warm in a single process and each source
+is compiled once per host instead of once per process.
+
+The daemon listens on a Unix domain socket, compiles the requested sources
+with epycc_compile and returns the libraries as object code (see
+JitLib.__getstate__) that the clients load into their own engine. Identical
+requests being compiled are deduplicated and the results are kept in a least
+recently used cache.
+
+Run the daemon with
+    epyccd.py [--socket PATH] [--max-bytes N]
+
+and compile from the clients with
+    import epyccd
+    lib = epyccd.compile(source, streaming=True)
+
+which falls back to compiling locally if the daemon is not running.
+
+Requests are length-prefixed JSON so the daemon never unpickles client data,
+responses are length-prefixed pickles, the socket is only accessible by the
+user running the daemon and clients refuse to connect to sockets owned by
+other users, since unpickling the responses can run arbitrary code.
+
+The socket is $EPYCCD_SOCKET, or epyccd.sock in $XDG_RUNTIME_DIR or in the
+private /tmp/epyccd-<uid> directory by default.
+"""
+
+import argparse
+import cPickle
+from collections import OrderedDict as odict
+import json
+import os
+import socket
+import SocketServer
+import struct
+import sys
+import threading
+
+from cstruct import Struct
+import epycc
+
+# Python 2 doesn't expose SO_PEERCRED, this is the Linux value
+SO_PEERCRED = getattr(socket, "SO_PEERCRED", 17 if sys.platform.startswith("linux") else None)
+
+def get_default_socket_path():
+    socket_path = os.environ.get("EPYCCD_SOCKET", None)
+    if (socket_path is None):
+        # Don't put the socket straight in the world-writable /tmp, where
+        # other users can create it first
+        dirpath = os.environ.get("XDG_RUNTIME_DIR", None)
+        if (dirpath is None):
+            dirpath = os.path.join("/tmp", "epyccd-%d" % os.getuid())
+        socket_path = os.path.join(dirpath, "epyccd.sock")
+
+    return socket_path
+
+def send_message(sock, data):
+    sock.sendall(struct.pack("!I", len(data)) + data)
+
+def recv_exactly(sock, size):
+    chunks = []
+    while (size > 0):
+        chunk = sock.recv(min(size, 1024 * 1024))
+        if (chunk == ""):
+            raise EOFError("Connection closed")
+        chunks.append(chunk)
+        size -= len(chunk)
+
+    return "".join(chunks)
+
+def recv_message(sock):
+    size, = struct.unpack("!I", recv_exactly(sock, 4))
+    return recv_exactly(sock, size)
+
+class CompileCache:
+    """
+    Pickled libraries by source and options, with deduplication of the
+    requests being compiled and a least recently used eviction policy that
+    keeps the pickled libraries under max_bytes
+    """
+    def __init__(self, max_bytes):
+        self.max_bytes = max_bytes
+        self.total_bytes = 0
+        self.lock = threading.Lock()
+        self.results = odict()
+        # Requests being compiled, by key
+        self.pending = dict()
+        self.hits = 0
+        self.misses = 0
+        self.deduplicated = 0
+
+    def get(self, source, options):
+        """
+        Return ("ok", pickled_lib) or ("error", message)
+        """
+        key = (epycc.get_source_hash(source), json.dumps(options, sort_keys=True))
+
+        with self.lock:
+            result = self.results.pop(key, None)
+            if (result is not None):
+                # Most recently used go last
+                self.results[key] = result
+                self.hits += 1
+                return result
+
+            pending = self.pending.get(key, None)
+            if (pending is None):
+                pending = Struct(event = threading.Event(), result = None)
+                self.pending[key] = pending
+                self.misses += 1
+                compile = True
+            else:
+                self.deduplicated += 1
+                compile = False
+
+        if (not compile):
+            # Wait for the identical request being compiled
+            pending.event.wait()
+            return pending.result
+
+        try:
+            lib = epycc.epycc_compile(source, **options)
+            result = ("ok", cPickle.dumps(lib, cPickle.HIGHEST_PROTOCOL))
+            lib.close()
+        except Exception as e:
+            result = ("error", "%s: %s" % (type(e).__name__, e))
+
+        with self.lock:
+            del self.pending[key]
+            # Errors are not cached, they may be transient
+            if (result[0] == "ok"):
+                self.results[key] = result
+                self.total_bytes += len(result[1])
+                self.evict(self.max_bytes)
+        pending.result = result
+        pending.event.set()
+
+        return result
+
+    def evict(self, max_bytes):
+        # Called with the lock held, the most recently used is never evicted
+        while ((self.total_bytes > max_bytes) and (len(self.results) > 1)):
+            key, result = self.results.popitem(last=False)
+            self.total_bytes -= len(result[1])
+
+class CompileRequestHandler(SocketServer.BaseRequestHandler):
+    def handle(self):
+        # Requests are
+        #   {"command": "compile", "source": source, "options": options}
+        #   {"command": "stats"}
+        # A connection can send several requests
+        while (True):
+            try:
+                request = json.loads(recv_message(self.request))
+            except EOFError:
+                break
+
+            if (request["command"] == "compile"):
+                # Keyword arguments must be str in Python 2
+                options = dict([(str(key), value) for key, value in request["options"].iteritems()])
+                if (options.get("libs", None) is not None):
+                    result = ("error", "ValueError: libs is not supported")
+                else:
+                    result = self.server.cache.get(request["source"].encode("utf-8"), options)
+
+            elif (request["command"] == "stats"):
+                cache = self.server.cache
+                result = ("ok", dict(hits = cache.hits, misses = cache.misses,
+                    deduplicated = cache.deduplicated, total_bytes = cache.total_bytes,
+                    entries = len(cache.results)))
+
+            else:
+                result = ("error", "Unknown command %s" % request["command"])
+
+            send_message(self.request, cPickle.dumps(result, cPickle.HIGHEST_PROTOCOL))
+
+class CompileServer(SocketServer.ThreadingMixIn, SocketServer.UnixStreamServer):
+    daemon_threads = True
+
+    def __init__(self, socket_path, max_bytes):
+        dirpath = os.path.dirname(os.path.abspath(socket_path))
+        if (not os.path.exists(dirpath)):
+            # Private directory, eg /tmp/epyccd-<uid>
+            os.makedirs(dirpath, 0700)
+        # Don't serve from directories created by other users, they could
+        # replace the socket
+        if (os.stat(dirpath).st_uid not in [os.getuid(), 0]):
+            raise RuntimeError("Socket directory %s owned by another user" % dirpath)
+        if (os.path.exists(socket_path)):
+            os.remove(socket_path)
+        # Only the user running the daemon can connect
+        umask = os.umask(0177)
+        try:
+            SocketServer.UnixStreamServer.__init__(self, socket_path, CompileRequestHandler)
+        finally:
+            os.umask(umask)
+        self.socket_path = socket_path
+        self.cache = CompileCache(max_bytes)
+
+    def server_close(self):
+        SocketServer.UnixStreamServer.server_close(self)
+        if (os.path.exists(self.socket_path)):
+            os.remove(self.socket_path)
+
+def request(sock, message):
+    send_message(sock, json.dumps(message))
+    status, result = cPickle.loads(recv_message(sock))
+    if (status != "ok"):
+        raise RuntimeError("Compile server error: %s" % result)
+
+    return result
+
+def connect(socket_path = None):
+    """
+    Connect to the compile server, raising socket.error if the socket is not
+    owned by this user or the server is run by another user
+    """
+    socket_path = socket_path or get_default_socket_path()
+    try:
+        st = os.stat(socket_path)
+    except OSError as e:
+        raise socket.error(e.errno, e.strerror)
+    if (st.st_uid != os.getuid()):
+        raise socket.error("Compile server socket %s owned by another user" % socket_path)
+
+    sock = socket.socket(socket.AF_UNIX, socket.SOCK_STREAM)
+    try:
+        sock.connect(socket_path)
+        # The socket could have been replaced after the check, verify the
+        # user of the process listening
+        if (SO_PEERCRED is not None):
+            pid, uid, gid = struct.unpack("3i", 
+                sock.getsockopt(socket.SOL_SOCKET, SO_PEERCRED, struct.calcsize("3i")))
+            if (uid != os.getuid()):
+                raise socket.error("Compile server %s run by another user" % socket_path)
+
+    except:
+        sock.close()
+        raise
+
+    return sock
+
+def compile(source, socket_path = None, fallback = True, **options):
+    """
+    Compile the source in the compile server and return the library, the
+    options are the same as epycc_compile's.
+
+    If fallback is True and the server can't be reached, the source is
+    compiled locally.
+
+    libs is not supported, linked libraries can't be sent to the server
+    """
+    if (options.get("libs", None) is not None):
+        raise ValueError("The compile server doesn't support libs, use epycc.epycc_compile")
+    try:
+        sock = connect(socket_path)
+    except socket.error:
+        if (not fallback):
+            raise
+        return epycc.epycc_compile(source, **options)
+
+    try:
+        pickled_lib = request(sock, dict(command = "compile", source = source, options = options))
+    finally:
+        sock.close()
+
+    return cPickle.loads(pickled_lib)
+
+def get_stats(socket_path = None):
+    sock = connect(socket_path)
+    try:
+        return request(sock, dict(command = "stats"))
+    finally:
+        sock.close()
+
+def main():
+    parser = argparse.ArgumentParser(description="epycc compile server")
+    parser.add_argument("--socket", default=get_default_socket_path(),
+        help="Unix domain socket path, $EPYCCD_SOCKET or epyccd.sock in $XDG_RUNTIME_DIR or /tmp/epyccd-<uid> by default")
+    parser.add_argument("--max-bytes", type=int, default=256 * 1024 * 1024,
+        help="maximum size of the cached object code")
+    args = parser.parse_args()
+
+    # Warm up the snippets IR and LLVM
+    epycc.epycc_compile("void epyccd_warm_up() { }").close()
+
+    server = CompileServer(args.socket, args.max_bytes)
+    print "Listening on", args.socket
+    try:
+        server.serve_forever()
+    finally:
+        server.server_close()
+
+if (__name__ == "__main__"):
+    main()
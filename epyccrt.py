@@ -0,0 +1,642 @@
+#!/usr/bin/env python
+"""
+epyccrt - epycc runtime
+
+Copyright (C) 2021 Antonio Tejada
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+Runtime support for the libraries compiled by epycc: argument marshalling,
+latency histograms, arenas and the loader of the shared objects saved with
+JitLib.save.
+
+This module doesn't depend on lark or llvmlite, so prebuilt libraries can be
+deployed and loaded with
+    import epyccrt
+    lib = epyccrt.load_lib("kernels.so")
+"""
+
+import ctypes
+import ctypes.util
+import functools
+import json
+import mmap
+import os
+import sys
+import threading
+import timeit
+
+from cstruct import Struct
+
+def tuplize(a):
+    # Nested lists need to be converted to nested tuples
+    # XXX This assumes that once it finds a tuple everything 
+    #     is tuples all the way
+    if (isinstance(a, list)):
+        l = []
+        for i in a:
+            l.append(tuplize(i))
+        return tuple(l)
+    else:
+        return a
+
+def deepcopy_list(l, c_arr):
+    for i in xrange(len(l)):
+        if (isinstance(l[i], list)):
+            deepcopy_list(l[i], c_arr[i])
+        else:
+            l[i] = c_arr[i]
+
+byte_ctypes = (ctypes.c_char, ctypes.c_byte, ctypes.c_ubyte)
+buffer_types = (str, bytearray, mmap.mmap)
+
+ctypes.pythonapi.PyObject_AsReadBuffer.argtypes = [ctypes.py_object, 
+    ctypes.POINTER(ctypes.c_void_p), ctypes.POINTER(ctypes.c_ssize_t)]
+
+class ReadOnlyBuffer(object):
+    """
+    Wrapper to pass a read-only buffer (str, read-only mmap) to a char array
+    parameter without copying it. The caller guarantees the function doesn't
+    write to the array, unwrapped read-only buffers are copied
+    """
+    def __init__(self, buf):
+        self.buf = buf
+
+def get_buffer_pointer(buf, ctype, copy_read_only = True):
+    """
+    Return a ctypes pointer of type ctype to the memory of the buffer object
+    buf without copying it.
+
+    Read-only buffers (str, read-only mmaps) are copied unless copy_read_only
+    is False, in which case C code must not write to them.
+
+    The pointer is only valid while buf is alive and not resized
+    """
+    try:
+        # Writable buffers (bytearray, mmap not opened with ACCESS_READ), the
+        # array keeps a reference to buf
+        return (ctype._type_ * len(buf)).from_buffer(buf)
+
+    except TypeError:
+        # Read-only buffers
+        if (copy_read_only):
+            return (ctype._type_ * len(buf)).from_buffer_copy(buf)
+
+        address = ctypes.c_void_p()
+        length = ctypes.c_ssize_t()
+        ctypes.pythonapi.PyObject_AsReadBuffer(buf, ctypes.byref(address), 
+            ctypes.byref(length))
+        return ctypes.cast(address, ctype)
+
+def marshal_args(argtypes, args):
+    """
+    Convert the Python arguments to ctypes arguments
+    """
+    _args = []
+    
+    for arg, ctype in zip(args, argtypes):
+        if (isinstance(arg, ctype) or (issubclass(ctype, ctypes._Pointer) and 
+            isinstance(arg, (ctypes.Array, ctypes._Pointer)))):
+            # Pass ctypes arrays and pointers straight without copying, so eg
+            # shared memory can be processed in place, see JitPool
+            _args.append(arg)
+
+        elif (issubclass(ctype, ctypes.Array)):
+            # Pass the list straight
+            _args.append(ctype(*tuplize(arg)))
+
+        elif (issubclass(ctype, ctypes._Pointer) and (ctype._type_ in byte_ctypes) and 
+              isinstance(arg, buffer_types)):
+            # Pass byte buffers straight without copying, so eg memory mapped
+            # files can be processed in place, read-only buffers are copied so
+            # C code can't modify them
+            _args.append(get_buffer_pointer(arg, ctype))
+
+        elif (issubclass(ctype, ctypes._Pointer) and (ctype._type_ in byte_ctypes) and 
+              isinstance(arg, ReadOnlyBuffer)):
+            # Pass read-only buffers without copying, the caller guarantees
+            # the function doesn't write to them
+            _args.append(get_buffer_pointer(arg.buf, ctype, False))
+
+        elif (issubclass(ctype, ctypes._Pointer)):
+            # Pointer to array, ignore the pointer, pass an array
+            tup = tuplize(arg)
+            c_arr = (len(tup) * ctype._type_)(*tup)
+            _args.append(c_arr)
+
+        else:
+            _args.append(ctype(arg))
+
+    return _args
+
+def copy_back_args(argtypes, args, _args):
+    """
+    Copy back the ctypes arguments modified by the call into the Python
+    arguments
+    """
+    for arg, ctype, _arg in zip(args, argtypes, _args):
+        if (_arg is arg):
+            # Passed straight, nothing to copy back
+            pass
+
+        elif (issubclass(ctype, ctypes.Array)):
+            assert False, "Missing copy back for array"
+
+        elif (issubclass(ctype, ctypes._Pointer)):
+            # Can't copy back tuples, only lists
+            # XXX This assumes that there are no lists if the 
+            #     topmost is not list
+            if (isinstance(arg, list)):
+                deepcopy_list(arg, _arg)
+
+        # XXX Other copybacks probably missing like structs, etc
+        #     May go through the pointer path?
+
+def marshal_wrapper(_cfunc, *args):
+    _args = marshal_args(_cfunc.argtypes, args)
+
+    # Invoke the function
+    res = _cfunc(*_args)
+    
+    copy_back_args(_cfunc.argtypes, args, _args)
+
+    return res
+
+def get_array_interface_kind(ctype):
+    """
+    Return the numpy array interface type kind of a scalar ctype, eg "f" for
+    c_float
+    """
+    code = ctype._type_
+    if (code in "fdg"):
+        kind = "f"
+    elif (code in "BHILQ"):
+        kind = "u"
+    elif (code == "?"):
+        kind = "b"
+    else:
+        kind = "i"
+
+    return kind
+
+def get_strided_args(arg, ndims, item_ctype):
+    """
+    Return the base address and the byte stride of each dimension of an object
+    exposing the numpy array interface (eg numpy arrays and their views),
+    without copying it.
+
+    The address is only valid while arg is alive. Raises TypeError if arg
+    doesn't have native byte order items of item_ctype and ValueError if it
+    doesn't have ndims dimensions, a data pointer or is read-only, since the
+    C function may write to it
+    """
+    interface = arg.__array_interface__
+    shape = interface["shape"]
+    if (len(shape) != ndims):
+        raise ValueError("Expected %d dimensions, got %d" % (ndims, len(shape)))
+    typestr = interface["typestr"]
+    itemsize = ctypes.sizeof(item_ctype)
+    # "|" is for items where the byte order is not relevant, eg bytes
+    byteorders = ["|", "=", "<" if (sys.byteorder == "little") else ">"]
+    if ((typestr[0] not in byteorders) or (typestr[1] != get_array_interface_kind(item_ctype)) or 
+        (int(typestr[2:]) != itemsize)):
+        raise TypeError("Expected native %s items, got %s" % (item_ctype.__name__, typestr))
+    if (interface["data"] is None):
+        raise ValueError("Array interface without data pointer not supported")
+    if (interface["data"][1]):
+        raise ValueError("Read-only arrays not supported")
+
+    strides = interface.get("strides", None)
+    if (strides is None):
+        # C-contiguous
+        strides = []
+        stride = itemsize
+        for dim in reversed(shape):
+            strides.insert(0, stride)
+            stride *= dim
+
+    return [interface["data"][0]] + list(strides)
+
+def strided_wrapper(_cfunc, _strided, *args):
+    """
+    Expand the strided array arguments into the base address and byte strides
+    taken by the C function, see epycc.type_is_strided_array.
+
+    _strided has None or (number of dimensions, item ctype) per argument
+    """
+    _args = []
+    for arg, strided in zip(args, _strided):
+        if (strided is None):
+            _args.append(arg)
+
+        else:
+            _args.extend(get_strided_args(arg, *strided))
+
+    return _cfunc(*_args)
+
+class timespec(ctypes.Structure):
+    _fields_ = [("tv_sec", ctypes.c_long), ("tv_nsec", ctypes.c_long)]
+
+def get_latency_timer():
+    """
+    Return a function returning a monotonic clock in integer nanoseconds.
+
+    Python 2's timeit.default_timer is time.time on Linux, a wall clock that
+    can step and at the current epoch only resolves ~238ns, so call
+    clock_gettime(CLOCK_MONOTONIC) instead, falling back to the default timer
+    if it's not available
+    """
+    clock_gettime = None
+    if (sys.platform.startswith("linux")):
+        # Older glibcs have clock_gettime in librt
+        for library_name in ["c", "rt"]:
+            library_filepath = ctypes.util.find_library(library_name)
+            if (library_filepath is None):
+                continue
+            # Don't release the GIL, the timespec is shared by all threads
+            clock_gettime = getattr(ctypes.PyDLL(library_filepath), "clock_gettime", None)
+            if (clock_gettime is not None):
+                break
+
+    if (clock_gettime is None):
+        default_timer = timeit.default_timer
+        def latency_timer():
+            return int(default_timer() * 1e9)
+
+        return latency_timer
+
+    CLOCK_MONOTONIC = 1
+    # No argtypes, the default int conversion and byref are enough and setting
+    # them triples the call overhead
+    ts = timespec()
+    ts_ref = ctypes.byref(ts)
+    def latency_timer():
+        clock_gettime(CLOCK_MONOTONIC, ts_ref)
+        return ts.tv_sec * 1000000000 + ts.tv_nsec
+
+    return latency_timer
+
+latency_timer = get_latency_timer()
+
+class LatencyHistogram:
+    """
+    Fixed-size histogram of call latencies with power of two nanosecond
+    buckets, one per call stage:
+    - marshal_in: converting the Python arguments to ctypes
+    - native: executing the C function
+    - copy_back: copying the ctypes arguments back to the Python arguments
+    - total: all of the above
+
+    Bucket i counts the latencies in [2^(i-1), 2^i) nanoseconds.
+
+    Recording is a few list increments done under the GIL, no locks are taken
+    (concurrent recordings from threads releasing the GIL in the native call
+    can at most lose a count)
+    """
+    stages = ["marshal_in", "native", "copy_back", "total"]
+    num_buckets = 64
+
+    def __init__(self):
+        self.reset()
+
+    def reset(self):
+        self.buckets = dict([(stage, [0] * self.num_buckets) for stage in self.stages])
+
+    def record(self, start, marshalled, called, copied):
+        max_bucket = self.num_buckets - 1
+        buckets = self.buckets
+        # The timestamps are integer nanoseconds, see latency_timer
+        buckets["marshal_in"][min((marshalled - start).bit_length(), max_bucket)] += 1
+        buckets["native"][min((called - marshalled).bit_length(), max_bucket)] += 1
+        buckets["copy_back"][min((copied - called).bit_length(), max_bucket)] += 1
+        buckets["total"][min((copied - start).bit_length(), max_bucket)] += 1
+
+    def count(self, stage = "total"):
+        return sum(self.buckets[stage])
+
+    def percentile(self, p, stage = "total"):
+        """
+        Return the upper bound in seconds of the bucket containing the
+        percentile p (0 to 100), None if there are no samples
+        """
+        buckets = self.buckets[stage]
+        count = sum(buckets)
+        if (count == 0):
+            return None
+        accumulated = 0
+        for i, bucket_count in enumerate(buckets):
+            accumulated += bucket_count
+            if (accumulated * 100.0 >= count * p):
+                break
+
+        return (1 << i) * 1e-9
+
+    def summary(self):
+        """
+        Return a dict with the count, p50 and p99 of each stage
+        """
+        return dict([(stage, dict(
+                count=self.count(stage), 
+                p50=self.percentile(50, stage), 
+                p99=self.percentile(99, stage)
+            )) for stage in self.stages])
+
+def latency_wrapper(_cfunc, _marshal, _histogram, *args):
+    start = latency_timer()
+    if (_marshal):
+        _args = marshal_args(_cfunc.argtypes, args)
+    else:
+        _args = args
+    marshalled = latency_timer()
+    
+    res = _cfunc(*_args)
+
+    called = latency_timer()
+    if (_marshal):
+        copy_back_args(_cfunc.argtypes, args, _args)
+    copied = latency_timer()
+
+    _histogram.record(start, marshalled, called, copied)
+
+    return res
+
+
+class ArenaHeader(ctypes.Structure):
+    _fields_ = [
+        ("base", ctypes.c_void_p), 
+        ("used", ctypes.c_uint64), 
+        ("capacity", ctypes.c_uint64), 
+        ("peak", ctypes.c_uint64),
+    ]
+
+class Arena:
+    """
+    Bump allocator used by the libraries compiled with arena=True to allocate
+    runtime sized arrays: allocation is O(1), there's no fragmentation and no
+    per-array free, the allocations of a scope are released when the scope
+    finishes and the whole arena when it's reset.
+
+    By default the arena is reset before every call from Python, with
+    reset_per_call=False the allocations accumulate until reset is called (or
+    the arena is exhausted, in which case the arrays are allocated in the
+    stack)
+
+    The same arena must not be used by functions running concurrently, see
+    get_thread_arena
+    """
+    def __init__(self, capacity, reset_per_call = True):
+        self.buffer = ctypes.create_string_buffer(capacity)
+        self.header = ArenaHeader(ctypes.addressof(self.buffer), 0, capacity, 0)
+        # Address passed in the functions' hidden arena parameter
+        self.address = ctypes.addressof(self.header)
+        self.reset_per_call = reset_per_call
+
+    @property
+    def capacity(self):
+        return self.header.capacity
+
+    @property
+    def used(self):
+        return self.header.used
+
+    @property
+    def peak(self):
+        """
+        Highest used bytes since creation, useful to size the arena
+        """
+        return self.header.peak
+
+    def reset(self):
+        self.header.used = 0
+
+default_arena_capacity = 1024 * 1024
+thread_arenas = threading.local()
+
+def get_thread_arena():
+    """
+    Return the calling thread's arena, used by the libraries with no explicit
+    arena so functions called from different threads don't share arenas
+    """
+    arena = getattr(thread_arenas, "arena", None)
+    if (arena is None):
+        arena = Arena(default_arena_capacity)
+        thread_arenas.arena = arena
+
+    return arena
+
+def arena_wrapper(_lib, _cfunc, *args):
+    arena = _lib.arena
+    if (arena is None):
+        arena = get_thread_arena()
+    if (arena.reset_per_call):
+        arena.reset()
+
+    return _cfunc(*(args + (arena.address,)))
+
+
+def closed_function(function_name, *args):
+    raise RuntimeError("Function %s called after closing its library" % function_name)
+
+def encode_ctype(ctype):
+    """
+    Return a picklable description of the ctypes type, see decode_ctype
+    """
+    if (ctype is None):
+        desc = None
+
+    elif (issubclass(ctype, ctypes._Pointer)):
+        desc = ("pointer", encode_ctype(ctype._type_))
+
+    elif (issubclass(ctype, ctypes.Array)):
+        desc = ("array", encode_ctype(ctype._type_), ctype._length_)
+
+    else:
+        desc = ("scalar", ctype.__name__)
+
+    return desc
+
+def decode_ctype(desc):
+    if (desc is None):
+        ctype = None
+
+    elif (desc[0] == "pointer"):
+        ctype = ctypes.POINTER(decode_ctype(desc[1]))
+
+    elif (desc[0] == "array"):
+        ctype = decode_ctype(desc[1]) * desc[2]
+
+    else:
+        ctype = getattr(ctypes, desc[1])
+
+    return ctype
+
+
+def encode_function_signatures(function_signatures):
+    """
+    Return a JSON serializable description of the function signatures, see
+    decode_function_signatures
+    """
+    return [dict(
+            name = function_signature.name,
+            ctypes = [encode_ctype(ctype) for ctype in function_signature.ctypes],
+            strided = [None if (strided is None) else (strided[0], encode_ctype(strided[1])) 
+                for strided in function_signature.strided],
+            counters = [counter.__dict__ for counter in function_signature.counters],
+            arena = function_signature.arena,
+            prototype = function_signature.prototype,
+        ) for function_signature in function_signatures]
+
+def decode_function_signatures(descs):
+    # Strings are unicode after a JSON round trip, convert them to str since
+    # they are used as attribute names
+    return [Struct(
+            name = str(desc["name"]),
+            ctypes = [decode_ctype(ctype_desc) for ctype_desc in desc["ctypes"]],
+            strided = [None if (strided is None) else (strided[0], decode_ctype(strided[1])) 
+                for strided in desc.get("strided", [])],
+            counters = [Struct(**dict([(str(key), str(value) if isinstance(value, unicode) else value) 
+                for key, value in counter.iteritems()])) for counter in desc["counters"]],
+            arena = desc["arena"],
+            prototype = desc.get("prototype", None),
+        ) for desc in descs]
+
+def bind_functions(lib, function_signatures, latency, get_function_address, 
+    get_global_value_address):
+    """
+    Expose the functions and counters as lib attributes, wrapping the
+    functions to marshal the arguments, record latencies and pass arenas as
+    needed.
+
+    get_function_address and get_global_value_address return the address of
+    the given symbol name, so the functions can come from a JIT engine or from
+    a shared object
+    """
+    lib.function_names = [function_signature.name for function_signature in function_signatures]
+    # Kept to pickle and save the library, see JitLib.__getstate__
+    lib.function_signatures = function_signatures
+    lib.latency_enabled = latency
+    # Arena used by the functions compiled with arena=True, if None each
+    # calling thread uses its own, see get_thread_arena
+    lib.arena = None
+
+    # Publish the execution counters, if instrumented
+    lib.counters = None
+    lib.counter_info = []
+    for function_signature in function_signatures:
+        lib.counter_info.extend(function_signature.counters)
+    if (len(lib.counter_info) > 0):
+        lib.counter_info.sort(key=lambda counter: counter.index)
+        counters_ptr = get_global_value_address("__epycc_counters")
+        counters = (ctypes.c_uint64 * len(lib.counter_info)).from_address(counters_ptr)
+        try:
+            # Expose as numpy if available, the numpy array shares the memory
+            # with the library global so it's always up to date
+            import numpy
+            counters = numpy.ctypeslib.as_array(counters)
+        except ImportError:
+            pass
+        lib.counters = counters
+    
+    for function_signature in function_signatures:
+
+        # Look up the function pointer (a Python int)
+        func_ptr = get_function_address(function_signature.name)
+
+        # Obtain a pointer to the function via ctypes
+        cfunc = ctypes.CFUNCTYPE(*function_signature.ctypes)(func_ptr)
+        raw_cfunc = cfunc
+        
+        # Convert the Python arguments to ctype arguments by wrapping the ctype
+        # function in a Python wrapper
+        marshal = any(
+            [(issubclass(ctype, ctypes.Array) or issubclass(ctype, ctypes._Pointer)) 
+            for ctype in function_signature.ctypes[1:]]
+        )
+        histogram = None
+        if (latency):
+            histogram = LatencyHistogram()
+            cfunc = functools.partial(latency_wrapper, cfunc, marshal, histogram)
+
+        elif (marshal):
+            # XXX Ideally this hould only override the __call__ so the 
+            #     user still sees a ctypes function
+            cfunc = functools.partial(marshal_wrapper, cfunc)
+
+        if (function_signature.arena):
+            cfunc = functools.partial(arena_wrapper, lib, cfunc)
+
+        if (any(function_signature.strided)):
+            cfunc = functools.partial(strided_wrapper, cfunc, function_signature.strided)
+
+        cfunc.latency = histogram
+        
+        setattr(lib, function_signature.name, cfunc)
+        setattr(lib, "__raw_" + function_signature.name, raw_cfunc)
+
+    # XXX Missing publishing the globals once there's global support
+
+
+class SharedLib(Struct):
+    """
+    Library of functions loaded from a shared object saved with JitLib.save,
+    the C functions are exposed as attributes like in JitLib
+    """
+    def close(self):
+        """
+        Stop exposing the library's functions, the shared object stays loaded
+        since ctypes can't unload it safely
+        """
+        if (self.dll is None):
+            return
+
+        for function_name in self.function_names:
+            closed = functools.partial(closed_function, function_name)
+            setattr(self, function_name, closed)
+            setattr(self, "__raw_" + function_name, closed)
+        self.counters = None
+        self.dll = None
+
+    def is_closed(self):
+        return (self.dll is None)
+
+    def __enter__(self):
+        return self
+
+    def __exit__(self, exc_type, exc_value, traceback):
+        self.close()
+
+def load_lib(filepath):
+    """
+    Load the shared object saved with JitLib.save and its metadata sidecar
+    filepath + ".json", returning a SharedLib with the same interface as the
+    JitLib that was saved
+    """
+    with open(filepath + ".json", "r") as f:
+        metadata = json.load(f)
+
+    # dlopen searches the library path for filenames without a slash, make
+    # sure the given file is loaded
+    dll = ctypes.CDLL(os.path.abspath(filepath))
+    lib = SharedLib(dll = dll, filepath = filepath)
+
+    def get_function_address(name):
+        return ctypes.cast(getattr(dll, name), ctypes.c_void_p).value
+
+    def get_global_value_address(name):
+        return ctypes.addressof(ctypes.c_uint64.in_dll(dll, name))
+
+    bind_functions(lib, decode_function_signatures(metadata["function_signatures"]),
+        metadata["latency"], get_function_address, get_global_value_address)
+    
+    return lib
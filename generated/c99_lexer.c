@@ -0,0 +1,31 @@
+
+// Generated by grammar.generate_dfa_scanner_c, 167 states,
+// 60 byte classes
+int c99_scan(unsigned char source[], int source_length, int start,
+    int char_classes[256], int transitions[10020], int accepts[10020],
+    int token_ends[], int token_kinds[], int max_tokens) {
+    int token_count = 0;
+    int pos = start;
+    while ((pos < source_length) && (token_count < max_tokens)) {
+        int state = 0;
+        int i = pos;
+        int match_end = pos + 1;
+        int match_kind = -1;
+        while (i < source_length) {
+            state = transitions[state + char_classes[source[i]]];
+            if (state < 0) {
+                break;
+            }
+            i = i + 1;
+            if (accepts[state] >= 0) {
+                match_end = i;
+                match_kind = accepts[state];
+            }
+        }
+        token_ends[token_count] = match_end;
+        token_kinds[token_count] = match_kind;
+        token_count = token_count + 1;
+        pos = match_end;
+    }
+    return token_count;
+}
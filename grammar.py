@@ -30,18 +30,25 @@ along with this program.  If not, see <http://www.gnu.org/licenses/>.
 # http://www.quut.com/c/ANSI-C-grammar-l-1999.html
 # http://www.quut.com/c/ANSI-C-grammar-y-1999.html
 # https://stackoverflow.com/questions/44141686/how-to-make-c-language-context-free
+import mmap
+import os
 import re
 import string
 import StringIO
 from cstruct import Struct
 
 
+# Set to False to silence the debug and progress output, eg when used as a
+# library from epycc
+verbose = True
+
 def vrb(*args):
     if (False):
         print (args)
 
 def dbg(*args):
-    print(args)
+    if (verbose):
+        print(args)
 
 
 def get_first(s):
@@ -108,7 +115,7 @@ def parse_grammar(grammar_text):
     for l in grammar_text:
         if (is_empty(l.strip())):
             # Allow and ignore empty lines
-            print "ignoring empty line"
+            assert None is dbg("ignoring empty line")
             
         # New symbol starts with parens, otherwise comment
         elif (l[0] == "("):
@@ -156,7 +163,7 @@ def parse_grammar(grammar_text):
                     
         else:
             # Comment
-            print "ignoring comment", repr(l)
+            assert None is dbg("ignoring comment", repr(l))
 
     return symbols
 
@@ -514,7 +521,7 @@ def find_lambda_closure(state):
     return lambda_closure
 
 
-def nfa_to_dfa(first_state):
+def nfa_to_dfa(first_state, minimize=True, priorities=None):
     """
     Take a lambda NFA/eNFA (NFA with epsilon moves) and convert to DFA.
 
@@ -529,6 +536,15 @@ def nfa_to_dfa(first_state):
     3. 
     4. Continue until there are no new states added to the NFA
     5. Mark as final any DFA state that includes a final state of the NFA
+    6. If minimize is True, minimize the resulting DFA, see minimize_dfa
+
+    priorities is an optional dict of NFA final state names to priority (lower
+    is higher priority), DFA states containing final NFA states with those
+    names are named after the highest priority one. This is used to tell which
+    token was matched when several match the same text (eg keyword and
+    identifier). That name is also stored as the accept of the DFA state, None
+    for the rest of states (note the other DFA state names are picked from
+    the NFA states in the closure and are not deterministic)
     """
     # XXX This should be done finding the lambda closures for all the states
     #     reusing the dependent lambda closure information
@@ -542,6 +558,13 @@ def nfa_to_dfa(first_state):
         # hashing into dictionaries, other sets
         return tuple(lambda_closure)
 
+    def get_priority_name(lambda_closure, default_name):
+        if (priorities is not None):
+            names = [_.name for _ in lambda_closure if (_.final and (_.name in priorities))]
+            if (not is_empty(names)):
+                return min(names, key=lambda name: priorities[name])
+        return default_name
+
     lambda_closures = {}
     closure_to_dfa_state = {}
 
@@ -562,12 +585,13 @@ def nfa_to_dfa(first_state):
         # XXX Should this pick the non fake if several exist?
         dfa_state_name = final_state_node_names[0]
     dfa_state =  create_state(
-        dfa_state_name,
+        get_priority_name(first_lambda_closure, dfa_state_name),
         # Final if any state in the lambda closure is final
         # XXX This should calculate whether the closure is final when generating
         #     it rather than after the fact
         any([_.final for _ in first_lambda_closure])
     )
+    dfa_state.accept = get_priority_name(first_lambda_closure, None)
     # XXX Cache this tuple?
     closure_to_dfa_state[first_lambda_closure] = dfa_state
 
@@ -629,10 +653,11 @@ def nfa_to_dfa(first_state):
                 # Add the closure of targets as new DFA state
                 target_dfa_state = create_state(
                     # XXX Pick another way of naming the state?
-                    tuple_targets_closure[0].name,
+                    get_priority_name(tuple_targets_closure, tuple_targets_closure[0].name),
                     # Final if any state in the lambda closure is final
                     any([_.final for _ in tuple_targets_closure])
                 )
+                target_dfa_state.accept = get_priority_name(tuple_targets_closure, None)
                 pending_closures.append(tuple_targets_closure)
                 closure_to_dfa_state[tuple_targets_closure] = target_dfa_state
                 
@@ -654,8 +679,12 @@ def nfa_to_dfa(first_state):
                 t.negated = True
                 t.charset.clear()
                 t.charset.update(negated_charset)
+
+    dfa = closure_to_dfa_state[first_lambda_closure]
+    if (minimize):
+        dfa = minimize_dfa(dfa)
         
-    return closure_to_dfa_state[first_lambda_closure]
+    return dfa
 
 
 def build_dot(first_states):
@@ -744,8 +773,19 @@ def build_dot(first_states):
     l.append("}")
     return string.join(l, "\n")
 
-def create_nfa_builder(symbols, terminal_symbols):
-    return Struct(nfa_stack = dict(), symbols = symbols, terminal_symbols = terminal_symbols)
+def create_nfa_builder(symbols, terminal_symbols, inline = False):
+    """
+    If inline is False the nfa of a symbol is built once and shared by all the
+    symbols referencing it, this is compact but the shared last state links to
+    the continuations of all the references, so the nfa accepts more than the
+    grammar (eg a digit-sequence from a floating-constant can end an
+    integer-constant).
+
+    If inline is True each reference builds its own copy of the nfa, only
+    recursive references are shared, which is exact for the lexical grammar.
+    """
+    return Struct(nfa_stack = dict(), symbols = symbols, 
+        terminal_symbols = terminal_symbols, inline = inline)
 
 def build_nfa(nfa_builder, symbol_name):
     # XXX This works for lexical grammars, but the phrase structure grammar has
@@ -764,7 +804,7 @@ def build_nfa(nfa_builder, symbol_name):
     terminal_symbols = nfa_builder.terminal_symbols
     nfa_stack = nfa_builder.nfa_stack
 
-    print "stack depth", len( nfa_stack.keys())
+    assert None is dbg("stack depth", len( nfa_stack.keys()))
     if (symbol_name in nfa_stack):
         return nfa_stack[symbol_name]
 
@@ -839,7 +879,9 @@ def build_nfa(nfa_builder, symbol_name):
         nfa.first.transitions.append(create_transition(all_nfa.first))
         all_nfa.last.transitions.append(create_transition(nfa.last))
                 
-        # del nfa_stack[symbol_name]
+        if (nfa_builder.inline):
+            del nfa_stack[symbol_name]
+
     return nfa
 
 def build_checkable_grammar(symbols, terminal_symbols, start_symbol):
@@ -902,7 +944,7 @@ def build_checkable_grammar(symbols, terminal_symbols, start_symbol):
     return grammar
 
 
-def build_lark_grammar(symbols, terminal_symbols, start_symbol):
+def build_lark_grammar(symbols, terminal_symbols, start_symbol, shape_tree = False):
     """
     Return the grammar in Lark format, rules in lowercase, terminals in
     uppercase.
@@ -911,6 +953,19 @@ def build_lark_grammar(symbols, terminal_symbols, start_symbol):
     (removing intermediate nodes, tokens, etc), but are not necessary just for
     parsing itself
 
+    If shape_tree is True, the rules are annotated to generate smaller trees
+    (to be used without keep_all_tokens):
+    - Rules with pass-through alternatives (eg the expression precedence 
+      levels "additive-expression: multiplicative-expression") are marked
+      with ? so the single child node is inlined instead of creating a chain
+      of single child nodes.
+    - Only rules with tokens other than punctuation (eg operators, keywords)
+      are marked with ! to keep their tokens, punctuation tokens are dropped
+      from the other rules.
+    - Left recursive lists (eg "identifier-list: identifier | identifier-list
+      , identifier") are flattened into a single node with the items as
+      children, "identifier_list: identifier ("," identifier)*"
+
     see https://lark-parser.readthedocs.io/en/latest/grammar.html
     see https://lark-parser.github.io/ide/#
 
@@ -944,27 +999,91 @@ def build_lark_grammar(symbols, terminal_symbols, start_symbol):
         # Terminal uppercase or in quotation marks
         return '"%s"' % escape_lark(s).encode("string_escape").replace('"', '\\"')
 
+    def escape_rule_symbols(rule):
+        ll = []
+        for rule_symbol in rule:
+            # rule symbols separated by " "
+            if (rule_symbol.symbol in terminal_symbols):
+                s = escape_terminal(rule_symbol.symbol)
+            
+            else:
+                s = escape_non_terminal(rule_symbol.symbol)
+            if (rule_symbol.opt):
+                s = s + "?"
+            ll.append(s)
+
+        return ll
+
+    def get_list_rule(symbol):
+        """
+        Return (separator, item rule) if the symbol is a left recursive list
+        of the form
+            symbol: item
+                 |  symbol separator? item
+        None otherwise
+        """
+        if ((not symbol.name.endswith("-list")) or (len(symbol.rules) != 2)):
+            return None
+        
+        base_rule, recursive_rule = symbol.rules
+        if (base_rule[0].symbol == symbol.name):
+            base_rule, recursive_rule = recursive_rule, base_rule
+        if ((recursive_rule[0].symbol != symbol.name) or recursive_rule[0].opt or 
+            any([rule_symbol.symbol == symbol.name for rule_symbol in base_rule])):
+            return None
+        
+        def rule_key(rule):
+            return [(rule_symbol.symbol, rule_symbol.opt) for rule_symbol in rule]
+        
+        if (rule_key(recursive_rule[1:]) == rule_key(base_rule)):
+            return None, base_rule
+        
+        elif ((recursive_rule[1].symbol in terminal_symbols) and (not recursive_rule[1].opt) and 
+              (rule_key(recursive_rule[2:]) == rule_key(base_rule))):
+            return recursive_rule[1], base_rule
+
+        return None
+
+    # Tokens that are only needed for parsing, dropped when shaping the tree
+    punctuation = set(["(", ")", "[", "]", "{", "}", ";", ",", ":"])
+
     l = []
     for symbol_name, symbol in symbols.items():
+        prefix = ""
+        list_rule = None
+        if (shape_tree):
+            list_rule = get_list_rule(symbol)
+            if (any([(rule_symbol.symbol in terminal_symbols) and (rule_symbol.symbol not in punctuation) 
+                for rule in symbol.rules for rule_symbol in rule])):
+                # Keep the operator, keyword, etc tokens of this rule
+                prefix += "!"
+            if ((list_rule is None) and any([(len(rule) == 1) and (not rule[0].opt) and 
+                (rule[0].symbol not in terminal_symbols) for rule in symbol.rules])):
+                # Inline the pass-through alternatives
+                prefix += "?"
+
+        if (list_rule is not None):
+            separator, base_rule = list_rule
+            ll = ["%s%s: " % (prefix, escape_non_terminal(symbol_name))]
+            ll.extend(escape_rule_symbols(base_rule))
+            ll.append("(")
+            if (separator is not None):
+                ll.extend(escape_rule_symbols([separator]))
+            ll.extend(escape_rule_symbols(base_rule))
+            ll.append(")*")
+            l.append(string.join(ll, " "))
+            continue
+
         # symbols separated by "\n"
         for i, rule in enumerate(symbol.rules):
             ll = []
             # rules in a symbol separated by "|" or : if it's the first rule
             if (i == 0):
-                ll.append("%s: " % escape_non_terminal(symbol_name))
+                ll.append("%s%s: " % (prefix, escape_non_terminal(symbol_name)))
             else:
                 ll.append("  | ")
             
-            for rule_symbol in rule:
-                # rule symbols separated by " "
-                if (rule_symbol.symbol in terminal_symbols):
-                    s = escape_terminal(rule_symbol.symbol)
-                
-                else:
-                    s = escape_non_terminal(rule_symbol.symbol)
-                if (rule_symbol.opt):
-                    s = s + "?"
-                ll.append(s)
+            ll.extend(escape_rule_symbols(rule))
 
             l.append(string.join(ll, " "))
             
@@ -1259,6 +1378,451 @@ def get_token_dfa(scanner_state):
         active_state = new_active_state
 
 
+def get_dfa_byte_targets(first_state):
+    """
+    Return Struct(states, byte_targets, byte_to_class, class_to_byte) where
+
+    - states is the list of DFA states in breadth first order so the first
+      state is 0, the targets of each state are visited in byte order so the
+      order doesn't depend on the order of the transitions
+    - byte_targets is the per state, per byte list of target state indices,
+      -1 for no transition
+    - byte_to_class maps each byte to its equivalence class, two bytes are in
+      the same class if every state transitions to the same target state with
+      both
+    - class_to_byte maps each class to a representative byte
+    """
+    states = [first_state]
+    state_to_index = { first_state : 0 }
+    byte_targets = []
+    i = 0
+    while (i < len(states)):
+        byte_target_states = [None] * 256
+        for t in states[i].transitions:
+            assert(not is_empty(t.charset))
+            if (t.negated):
+                charset = [chr(c) for c in xrange(256) if chr(c) not in t.charset]
+            else:
+                charset = t.charset
+            for c in charset:
+                byte_target_states[ord(c)] = t.target
+
+        targets = [-1] * 256
+        for c, target in enumerate(byte_target_states):
+            if (target is None):
+                continue
+            target_index = state_to_index.get(target, None)
+            if (target_index is None):
+                target_index = len(states)
+                state_to_index[target] = target_index
+                states.append(target)
+            targets[c] = target_index
+        byte_targets.append(targets)
+        i += 1
+
+    column_to_class = {}
+    byte_to_class = []
+    class_to_byte = []
+    for c in xrange(256):
+        column = tuple([targets[c] for targets in byte_targets])
+        char_class = column_to_class.get(column, None)
+        if (char_class is None):
+            char_class = len(class_to_byte)
+            column_to_class[column] = char_class
+            class_to_byte.append(c)
+        byte_to_class.append(char_class)
+
+    return Struct(states = states, byte_targets = byte_targets, 
+        byte_to_class = byte_to_class, class_to_byte = class_to_byte)
+
+def minimize_dfa(first_state):
+    """
+    Minimize the DFA using Hopcroft's partition refinement and return the
+    first state of the new, minimal DFA.
+
+    Final states are only merged if they have the same accept (see
+    nfa_to_dfa) since it's the token returned by the scanners, final states
+    without accept are all equivalent. The new states are named after their
+    accept or "@<index>" in breadth first order, so the minimized DFA doesn't
+    depend on the arbitrary names of the original states and minimizing the
+    same language always returns the same DFA. Transitions to no state are treated
+    as transitions to an implicit dead state, states equivalent to the dead
+    state (non final states that cannot reach a final state) are removed,
+    which doesn't change the longest match.
+
+    The refinement works on byte equivalence classes instead of the 256 bytes,
+    see get_dfa_byte_targets
+    """
+    dfa_targets = get_dfa_byte_targets(first_state)
+    states = dfa_targets.states
+    class_to_byte = dfa_targets.class_to_byte
+    num_states = len(states)
+    dead_state = num_states
+
+    # Inverse transitions per class, including the dead state
+    inverse_targets = []
+    for c in class_to_byte:
+        inverse = [[] for _ in xrange(num_states + 1)]
+        for state_index, targets in enumerate(dfa_targets.byte_targets):
+            target_index = targets[c]
+            inverse[target_index if (target_index != -1) else dead_state].append(state_index)
+        # The dead state transitions to itself
+        inverse[dead_state].append(dead_state)
+        inverse_targets.append(inverse)
+
+    # Initial partition, non final states and final states per accept
+    accept_to_block = {}
+    non_final_block = set([dead_state])
+    for state_index, state in enumerate(states):
+        if (state.final):
+            accept_to_block.setdefault(state.accept, set()).add(state_index)
+        else:
+            non_final_block.add(state_index)
+    partition = [non_final_block] + [accept_to_block[accept] for accept in sorted(accept_to_block)]
+    state_to_block = [None] * (num_states + 1)
+    for block_index, block in enumerate(partition):
+        for state_index in block:
+            state_to_block[state_index] = block_index
+
+    pending_splitters = set(xrange(len(partition)))
+    while (len(pending_splitters) > 0):
+        splitter = partition[pending_splitters.pop()]
+        for inverse in inverse_targets:
+            # States that transition into the splitter with this class,
+            # grouped by the block they belong to
+            block_to_sources = {}
+            for target_index in splitter:
+                for source_index in inverse[target_index]:
+                    block_to_sources.setdefault(state_to_block[source_index], set()).add(source_index)
+
+            for block_index, sources in block_to_sources.iteritems():
+                block = partition[block_index]
+                if (len(sources) == len(block)):
+                    continue
+                # Split the block, keep the bigger half in place
+                remaining = block - sources
+                if (len(sources) > len(remaining)):
+                    sources, remaining = remaining, sources
+                partition[block_index] = remaining
+                new_block_index = len(partition)
+                partition.append(sources)
+                for state_index in sources:
+                    state_to_block[state_index] = new_block_index
+                # If the split block is pending both halves need to be
+                # pending, otherwise the smaller half is enough
+                pending_splitters.add(new_block_index)
+
+    # Build the new states, one per block except the dead state block, in the
+    # order of their first state
+    dead_block_index = state_to_block[dead_state]
+    block_to_state = {}
+    block_indices = sorted([block_index for block_index in xrange(len(partition)) 
+        if (block_index != dead_block_index)], key=lambda block_index: min(partition[block_index]))
+    for new_state_index, block_index in enumerate(block_indices):
+        representative = states[min(partition[block_index])]
+        name = representative.accept
+        if (name is None):
+            name = "@%d" % new_state_index
+        state = create_state(name, representative.final)
+        state.accept = representative.accept
+        block_to_state[block_index] = state
+
+    for block_index, state in block_to_state.iteritems():
+        representative_index = min(partition[block_index])
+        targets = dfa_targets.byte_targets[representative_index]
+        target_to_transition = {}
+        for c in xrange(256):
+            target_index = targets[c]
+            if (target_index == -1):
+                continue
+            target_block_index = state_to_block[target_index]
+            if (target_block_index == dead_block_index):
+                continue
+            transition = target_to_transition.get(target_block_index, None)
+            if (transition is None):
+                transition = create_transition(block_to_state[target_block_index])
+                target_to_transition[target_block_index] = transition
+                state.transitions.append(transition)
+            transition.charset.add(chr(c))
+
+        # Compact the charset by turning into negated if more than 128 elements
+        for t in state.transitions:
+            if (len(t.charset) > 128):
+                negated_charset = [chr(i) for i in xrange(256) if chr(i) not in t.charset]
+                t.negated = True
+                t.charset.clear()
+                t.charset.update(negated_charset)
+
+    if (verbose):
+        print "minimized dfa states from", num_states, "to", len(block_to_state)
+
+    return block_to_state[state_to_block[0]]
+
+def build_dfa_tables(first_state):
+    """
+    Compile the DFA into dense tables for a table driven scanner:
+
+    - Bytes are grouped in equivalence classes, two bytes are in the same
+      class if every state transitions to the same target state with both, the
+      C99 lexical grammar only needs a few dozen classes instead of 256.
+      char_classes is a 256 chars string usable with str.translate that maps
+      each byte to its class.
+    - transitions is a flat list indexed by state + class where each state is
+      stored premultiplied by the number of classes (the offset of the state
+      row), so the inner loop doesn't need multiplications. Transitions to no
+      state are -1. The first state is at offset 0.
+    - accepts is indexed by state offset and contains the name of the state
+      for final states, None otherwise.
+
+    Returns Struct(num_states, num_classes, char_classes, transitions, accepts,
+    names)
+    """
+    dfa_targets = get_dfa_byte_targets(first_state)
+    states = dfa_targets.states
+    byte_targets = dfa_targets.byte_targets
+    byte_to_class = dfa_targets.byte_to_class
+    class_to_byte = dfa_targets.class_to_byte
+
+    num_classes = len(class_to_byte)
+    transitions = []
+    accepts = [None] * (len(states) * num_classes)
+    for state_index, state in enumerate(states):
+        for c in class_to_byte:
+            target_index = byte_targets[state_index][c]
+            transitions.append(target_index * num_classes if (target_index != -1) else -1)
+        if (state.final):
+            accepts[state_index * num_classes] = state.name
+
+    return Struct(
+        num_states = len(states),
+        num_classes = num_classes,
+        char_classes = string.join([chr(char_class) for char_class in byte_to_class], ""),
+        transitions = transitions,
+        accepts = accepts,
+        names = [state.name for state in states]
+    )
+
+def scan_dfa_tables(tables, buffer, chunk_size = 64 * 1024):
+    """
+    Generator of (match_state, match_word) tokens scanning the buffer with the
+    DFA tables, using maximal munch (the longest match).
+
+    Unmatched characters are returned one at a time as (None, char), same as
+    get_token_dfa.
+
+    The buffer can be a string or an mmap'd file. The buffer is converted to
+    equivalence classes chunk_size bytes at a time with str.translate, so the
+    inner loop is just indexing into lists and the memory used is proportional
+    to the chunk size (plus the longest token) instead of the buffer size.
+    """
+    char_classes = tables.char_classes
+    transitions = tables.transitions
+    accepts = tables.accepts
+    data_length = len(buffer)
+
+    # Equivalence classes of the bytes from classes_start to classes_end
+    classes = bytearray()
+    classes_start = 0
+    classes_end = 0
+
+    pos = 0
+    while (pos < data_length):
+        state = 0
+        i = pos
+        match_end = pos + 1
+        match_state = None
+        while (i < data_length):
+            if (i == classes_end):
+                # Translate the next chunk, keeping the classes of the current
+                # token in case it needs to be rescanned from pos
+                # Note slicing mmaps returns a string
+                classes = classes[pos - classes_start:] + \
+                    bytearray(buffer[i:i + chunk_size].translate(char_classes))
+                classes_start = pos
+                classes_end = classes_start + len(classes)
+            state = transitions[state + classes[i - classes_start]]
+            if (state < 0):
+                break
+            i += 1
+            accept = accepts[state]
+            if (accept is not None):
+                match_end = i
+                match_state = accept
+
+        yield match_state, buffer[pos:match_end]
+        pos = match_end
+
+def scan_dfa_tables_file(tables, filepath):
+    """
+    Generator of tokens in the file scanned with the DFA tables, the file is
+    mmap'd instead of read
+    """
+    with open(filepath, "rb") as f:
+        # Can't mmap empty files
+        if (os.fstat(f.fileno()).st_size == 0):
+            return
+        m = mmap.mmap(f.fileno(), 0, access=mmap.ACCESS_READ)
+        try:
+            for token in scan_dfa_tables(tables, m):
+                yield token
+        finally:
+            m.close()
+
+def scan_dfa_table(tables, filepath):
+    token_count = 0
+    for token in scan_dfa_tables_file(tables, filepath):
+        assert None is dbg(token)
+        token_count += 1
+    print "EOF", token_count, "tokens"
+
+def benchmark_dfa_scanner(dfa, filepaths, number = 1):
+    """
+    Compare the per character scanner and the table driven scanner on the
+    given files, verifying both produce the same tokens
+    """
+    import timeit
+
+    start_time = timeit.default_timer()
+    tables = build_dfa_tables(dfa)
+    print "built tables in", timeit.default_timer() - start_time, "secs,", \
+        tables.num_states, "states", tables.num_classes, "classes"
+
+    for filepath in filepaths:
+        size = os.path.getsize(filepath)
+
+        def scan_tokens():
+            with open(filepath, "r") as f:
+                scanner = create_dfa_scanner(dfa, f)
+                tokens = []
+                while (True):
+                    token = get_token_dfa(scanner)
+                    if (token is None):
+                        break
+                    tokens.append(token)
+            return tokens
+
+        def scan_table_tokens():
+            return list(scan_dfa_tables_file(tables, filepath))
+
+        assert scan_tokens() == scan_table_tokens(), "Scanners mismatch on %s" % filepath
+
+        for name, fn in [("dfa", scan_tokens), ("dfa table", scan_table_tokens)]:
+            t = min(timeit.Timer(fn).repeat(repeat=3, number=number)) / number
+            print "%-10s %s %d bytes %.3f secs %.0f bytes/sec" % (name, filepath, size, t, size / t)
+
+
+# Token kinds of the C99 lexical grammar recognized by the C99 lexer, in
+# priority order (keywords are also identifiers)
+c99_lexer_token_kinds = [
+    "keyword", "identifier", "floating-constant", "integer-constant", 
+    "character-constant", "string-literal", "punctuator", "whitespace", 
+    "comments"
+]
+
+def build_lexer_dfa(lexical_grammar_filepath, token_kinds, minimize = True):
+    """
+    Build the DFA for the given token kinds of the lexical grammar, the
+    accept of each final state is the highest priority token kind it matches
+    (see nfa_to_dfa).
+
+    Each token kind gets its own final state so the kind of the token is known
+    after scanning. The nfas are inlined so each token kind only accepts its
+    own language (see create_nfa_builder).
+    """
+    with open(lexical_grammar_filepath, "r") as f:
+        symbols = parse_grammar(f.read().splitlines())
+    terminal_symbols = find_terminal_symbols(symbols)
+    nfa_builder = create_nfa_builder(symbols, terminal_symbols, True)
+    
+    nfas = []
+    for token_kind in token_kinds:
+        nfa = build_nfa(nfa_builder, token_kind)
+        nfas.append(nfa)
+        # Note nfas of non terminal symbols are shared, so the final state
+        # can't be nfa.last itself, add a lambda to a new final state
+        final_state = create_state(token_kind, True)
+        nfa.last.transitions.append(create_transition(final_state))
+    nfa = build_union_nfa("token", nfas)
+
+    return nfa_to_dfa(nfa.first, minimize, 
+        dict([(token_kind, i) for i, token_kind in enumerate(token_kinds)]))
+
+def build_lexer_tables(lexical_grammar_filepath, token_kinds):
+    """
+    Build the minimized DFA for the given token kinds of the lexical grammar
+    (see build_lexer_dfa) and return its dense tables (see build_dfa_tables)
+    with the accepts converted to indices into token_kinds (-1 for non final
+    states), ready to be passed to the scanner generated by
+    generate_dfa_scanner_c.
+    """
+    dfa = build_lexer_dfa(lexical_grammar_filepath, token_kinds)
+    tables = build_dfa_tables(dfa)
+
+    return Struct(
+        token_kinds = list(token_kinds),
+        num_states = tables.num_states,
+        num_classes = tables.num_classes,
+        char_classes = [ord(c) for c in tables.char_classes],
+        transitions = tables.transitions,
+        accepts = [token_kinds.index(accept) if (accept is not None) else -1 
+            for accept in tables.accepts],
+    )
+
+def generate_dfa_scanner_c(tables, function_name = "dfa_scan"):
+    """
+    Generate the C source of a scanner for the dense DFA tables returned by
+    build_lexer_tables.
+
+    The C code scans the source from start, storing the end position and the
+    kind of each token (-1 for unmatched characters, which are returned one
+    at a time) until the end of the source or until max_tokens are stored,
+    and returns the number of tokens stored. The caller can resume scanning
+    from the end of the last token.
+
+    The tables are passed as parameters instead of being embedded since epycc
+    doesn't support initialized global arrays yet
+    """
+    # XXX Once epycc supports initialized global arrays the tables could be
+    #     embedded in the source
+    return """
+// Generated by grammar.generate_dfa_scanner_c, %(num_states)d states,
+// %(num_classes)d byte classes
+int %(function_name)s(unsigned char source[], int source_length, int start,
+    int char_classes[256], int transitions[%(num_transitions)d], int accepts[%(num_transitions)d],
+    int token_ends[], int token_kinds[], int max_tokens) {
+    int token_count = 0;
+    int pos = start;
+    while ((pos < source_length) && (token_count < max_tokens)) {
+        int state = 0;
+        int i = pos;
+        int match_end = pos + 1;
+        int match_kind = -1;
+        while (i < source_length) {
+            state = transitions[state + char_classes[source[i]]];
+            if (state < 0) {
+                break;
+            }
+            i = i + 1;
+            if (accepts[state] >= 0) {
+                match_end = i;
+                match_kind = accepts[state];
+            }
+        }
+        token_ends[token_count] = match_end;
+        token_kinds[token_count] = match_kind;
+        token_count = token_count + 1;
+        pos = match_end;
+    }
+    return token_count;
+}
+""" % dict(
+        function_name = function_name,
+        num_states = tables.num_states,
+        num_classes = tables.num_classes,
+        num_transitions = len(tables.transitions)
+    )
+
+
 def print_nfa_stats(first_states):
     
     print "first states:", len(first_states)
@@ -1318,7 +1882,7 @@ def scan_dfa(first_state, filepath):
 
 
 def find_terminal_symbols(symbols):
-    print "terminal symbols"
+    assert None is dbg("terminal symbols")
     
     terminal_symbols = set()
     for symbol_name, symbol in symbols.items():
@@ -1332,258 +1896,161 @@ def find_terminal_symbols(symbols):
 
 
 def parse_top_down(symbols, start_symbol, program_tokens):
-    def is_terminal(symbol):
-        return symbol not in symbols
-
-    def rule_str(symbol, rule_index, rule_symbol_index = 0):
-        return "%s[%d] : %s" % (
-            symbol.name, 
-            rule_index,
-            string.join(
-                [rule_symbol.symbol for rule_symbol in symbol.rules[rule_index][:rule_symbol_index]] +
-                ["^"] +
-                [rule_symbol.symbol for rule_symbol in symbol.rules[rule_index][rule_symbol_index:]],
-                " "
-            )
-        )
+    """
+    Memoized top down (packrat) parser with support for direct and indirect
+    left recursion.
 
-    def parse_symbol(parser, symbol):
-        """
-        Return false if the symbol failed to be parsed
+    Returns the parse tree for the whole program_tokens as nested 
+    Struct(symbol, rule_index, children) where children are trees, tokens, or
+    None for optional symbols not present. Returns None if the tokens can't
+    be parsed.
 
+    Results are memoized by (symbol, token index) so each symbol is parsed at
+    most once per token index, which makes the parse linear in the number of
+    tokens for the deterministic parts of the grammar.
 
-        Issues with top down parsers:
-        - When memoizing you need to use the token index and the full recursive
-          symbol stack as key, using the token index and the failed symbol is
-          not enough, eg
+    Choice
+    ======
 
-            type-name: ID 
-            type-qual: ID 
-            identifier: ID 
-            parameter: type-name identifier
-            parameter: type-name type-qual identifier
-            parameters: parameter
-            parameters: parameter , parameters
-            
-          Looks like this is what it's called "non-deterministic grammar" and
-          is not supposed to be handled by packrat
-          This can be solved by doing both of
-          - enlarging the memoing key to contain all the 
-          symbols in the descent path and not just the final symbol
-          - not memoing successes, only failures
-
-        - Left recursivity 
-            A: Aa
-               a
-            A: Ba
-               a
-            B: Ab
-            This can either be transformed to right recursivity with lambda
-            (but probably won't work with indirect recursion unless all the rules
-            in the grammar are changed to start with a terminal? 
-            changing to right recursivity will also break left associativity
-            in the grammar)
-            or the call can succeed until the accepted token string doesn't grow anymore
-            
-            Note at least in the direct case there must be another rule for
-            that symbol that is not recursive or the rule would never end, so 
-            when it fails there's always one rule that can take over the failure
-            in that same symbol without having to backtrack.
-            
-            XXX Left recursivity support is not implemented yet, probably needs
-                something like described above where a recursive rule is let to
-                recurse with iteratively increasing recursion depths, until there's 
-                no progress reading the token string.
-                
-                This requires failing the recursion at some point (so the other 
-                non-recursive rules in this symbol are tried and the token string
-                advanced), but also being able to make the recursion not fail 
-                once the max depth is increased again. It's possible the failure 
-                key will need to be enlarged to store the current max recursion 
-                level too
-
-
-            Left recursivity exhibits like this
-                S : A <EOF>
-                A : ab
-                    A cd
-            Given the token stream "abcdcdcd":
-            token index symbol[rule]    token, stack[rule]  comments
-            ab      0   S[0]: ^A EOF       
-            ab      0   A[0]: ^ab          (0, S[0])        success and advance of token
-            cd      1   A[0]: ab^          (0, S[0])        no more symbols in the rule, return to parent
-            cd      1   S[0]: A^EOF        ()               failure, added (0, (S[0], A[0])) to failures, reset rule index, token index
-            ab      0   S[0]: ^A EOF       ()               recurse into A
-            ab      0   A[0]: ^ab          (0, S[0])        failed because of previous failure, next rule
-            ab      0   A[1]: ^A cd        (0, S[0])        recurse into A 
-            ab      0   AA[0]: ^ab         (0, S[0], A[1])  success and advance of token (left recursion detected)
-            cd      1   AA[0]: ab          (0, S[0], A[1])  no more symbols in the rule, return to parent
-            cd      1   A[1]:  A^cd        (0, S[0])        success and advance of token
-            cd      2   AA[1]: A cd^       (0, S[0])        no more symbols in the rule, return to parent
-            cd      2   S[0]: A^EOF        ()               failure, added (0, S0, A[1]) to failures, reset rule index, token index
-            ab      0   S[0]: ^A EOF       ()               recurse into A
-            ab      0   A[0]: ^ab          (0, S[0])        failed because of previous failure (S[0], A[0]), next rule
-            ab      0   A[0]: ^ab          (0, S[0])        failed because of previous failure (S[0], A[1]), next rule
+    Unlike PEG ordered choice, the grammars in the spec are not written with
+    rule order in mind, eg
 
-        """
-        
-        print "parsing token[%d]" % parser.token_index, parser.tokens[parser.token_index], "depth", parser.depth, "stack", parser.stack, "+", symbol.name
-        ## print "success stack", parser.success_stack
-
-        assert len(parser.success_stack) == parser.token_index
-
-        max_parser_depth = 20
-        if (parser.depth >= max_parser_depth):
-            print "depth overflow"
-            # Record the failure
-            # XXX This is not correct anymore
-            parser.failures.add(key)
-            return False
-
-        original_token_index = parser.token_index
-        rule_index = 0
-        while (rule_index < len(symbol.rules)):
-            rule = symbol.rules[rule_index]
-
-            parser.depth += 1
-            parser.stack.append( (symbol.name, rule_index) )
-
-            # At least one rule must succeed to parse
-            res = True
-            rule_failed = False
-            key = (parser.token_index, tuple(parser.stack))
-            if (key in parser.failures):
-                print "failing previous failure for rule", rule_str(symbol, rule_index), "with token[%d]" % parser.token_index, parser.tokens[parser.token_index]
-                res = False
-                rule_failed = True
-                rule_symbol = rule[0]
-            
-            rule_symbol_index = 0
-            while not rule_failed and (rule_symbol_index < len(rule)):
-                
-                rule_symbol = rule[rule_symbol_index]
-                print "parsing token[%d]" % parser.token_index, parser.tokens[parser.token_index], "for rule", rule_str(symbol, rule_index, rule_symbol_index)
+        parameters: parameter
+        parameters: parameter , parameters
 
-                # All the rule symbols must succeed to parse
-                rule_symbol_token_index = parser.token_index
-                if (is_terminal(rule_symbol.symbol)):
-                    res = (parser.tokens[parser.token_index] == rule_symbol.symbol)
-                    if (res):
-                        assert (len(parser.success_stack) == parser.token_index)
-                        # Store the success information in case it needs to be redone
-                        success_stack_entry = Struct(
-                            token_index=parser.token_index,
-                            key=key, 
-                            rule_index=rule_index, 
-                            rule_symbol_index=rule_symbol_index,
-                            symbol = symbol.name,
-                        )
-                        parser.success_stack.append(success_stack_entry)
-                        # Advance the token, go to the next symbol in this rule
-                        parser.token_index += 1
-                        if (parser.token_index == len(parser.tokens)):
-                            # XXX This can probably be simplified since it's
-                            #     always the last terminal of the start rule
-                            print "Parsed full tokens!!!"
-                            return True
-                            
-                else:
-                    
-                    res = parse_symbol(parser, symbols[rule_symbol.symbol])
+    would never parse the second rule with ordered choice. Instead of a single
+    result, parsing a symbol at a token index returns all the token indices
+    where that symbol can end (with one tree per end index), and parsing a
+    rule combines the ends of each rule symbol. This also handles optional
+    symbols that must not be consumed greedily for the rest of the rule to
+    parse, eg
 
-                    if (parser.token_index == len(parser.tokens)):
-                        return True
+        type-declarator: type-qual opt type-name
 
-                if (not res):
-                    if (rule_symbol.opt):
-                        # Failing on optional rule_symbols is ok, just restore
-                        # the token to the previous symbol and continue
-                        
-                        # XXX What if this optional has a rule that was tagged
-                        #     as failure for a given token index because of
-                        #     something this optional did?
-                        parser.token_index = rule_symbol_token_index
-                        if (parser.token_index != len(parser.success_stack)):
-                            print "popping success entries", parser.success_stack[parser.token_index:]
-                            del parser.success_stack[parser.token_index:]
-                            assert (parser.token_index == len(parser.success_stack))
-
-                        # Tag as success in case this optional symbol is the
-                        # last one in the rule
-                        res = True
-                        
-                    else:
-                        # Go to the next rule, token will be restored below if
-                        # needed
-                        break
+    For unambiguous grammars there's normally a single end per symbol and
+    token index.
 
-                rule_symbol_index += 1
+    Left recursion
+    ==============
 
-            if (res):
-                # One rule succeeded, return to the parent with the updated
-                # token
-                print "token[%d]" % (parser.token_index-1), repr(parser.tokens[parser.token_index-1]), "succeeded on rule", rule_str(symbol, rule_index, rule_symbol_index)
-                parser.stack.pop()
-                parser.depth -= 1
-                break
+    Left recursion is supported by growing the seed as described in "Packrat
+    Parsers Can Support Left Recursion" (Warth et al). When a symbol is being
+    parsed at a token index and is reentered at the same token index, the
+    reentry returns the ends found so far (initially none, the seed). Once the
+    rules of the symbol are parsed, if the reentry happened, the symbol is
+    parsed again with the new ends as seed until no new ends are found.
 
-            else:
-                # Note we may not have a rule_symbol if the rule failed early, 
-                print "token[%d]" % parser.token_index, repr(parser.tokens[parser.token_index]), "failed on rule", rule_str(symbol, rule_index, rule_symbol_index)
-
-                # Restore the parser token, try the next rule
-                parser.token_index = original_token_index
-
-                # Update the success stack
-                if (parser.token_index != len(parser.success_stack)):
-                    print "popping success entries", parser.success_stack
-                    # Tag the last success as failure so it gets retried, pop
-                    # the other successes but don't tag them as failure as the
-                    # last success may have other rules that may still set the
-                    # other as successes
-                    success_stack_entry = parser.success_stack[-1]
-                    assert len(parser.success_stack)-1 == success_stack_entry.token_index
-
-                    success_key = success_stack_entry.key
-                    parser.failures.add(success_key)
-                        
-                    del parser.success_stack[parser.token_index:]
-                    assert (parser.token_index == len(parser.success_stack))    
-                    # Force to retry this rule 
-                    rule_index -= 1
+    The symbols parsed between the left recursive symbol and its reentry
+    (eg B in A: B a, B: A b) are involved in the recursion and their memoized
+    results are discarded before each growing iteration so they see the
+    grown seed.
+    """
+    tokens = program_tokens
+    memo = {}
+    stack = []
 
-            rule_index += 1
+    def is_terminal(symbol_name):
+        return symbol_name not in symbols
 
-            parser.stack.pop()
-            parser.depth -= 1
+    def parse_terminal(symbol_name, token_index):
+        if ((token_index < len(tokens)) and (tokens[token_index] == symbol_name)):
+            return { token_index + 1 : tokens[token_index] }
+        return {}
 
-        if (not res):
-            # record the failure if not already
-            parser.failures.add(key)
+    def parse_rule(symbol, rule_index, token_index):
+        """
+        Return dict of end token index to children list for the given rule
+        """
+        partials = { token_index : [] }
+        for rule_symbol in symbol.rules[rule_index]:
+            new_partials = {}
+            for start_index in sorted(partials.keys()):
+                children = partials[start_index]
+                if (is_terminal(rule_symbol.symbol)):
+                    ends = parse_terminal(rule_symbol.symbol, start_index)
+                else:
+                    ends = parse_symbol(rule_symbol.symbol, start_index)
+                for end_index in sorted(ends.keys()):
+                    if (end_index not in new_partials):
+                        new_partials[end_index] = children + [ends[end_index]]
+                if (rule_symbol.opt and (start_index not in new_partials)):
+                    new_partials[start_index] = children + [None]
+            partials = new_partials
+            if (is_empty(partials)):
+                break
 
-        return res
+        return partials
+
+    def parse_symbol_rules(symbol, token_index):
+        """
+        Return dict of end token index to tree for all the rules of the symbol
+        """
+        ends = {}
+        if (symbol.none_of):
+            # "none of" symbols match any token not in the rules
+            if ((token_index < len(tokens)) and 
+                (tokens[token_index] not in set([rule[0].symbol for rule in symbol.rules]))):
+                ends[token_index + 1] = Struct(symbol=symbol.name, rule_index=None, 
+                    children=[tokens[token_index]])
+            return ends
+
+        for rule_index in xrange(len(symbol.rules)):
+            for end_index, children in parse_rule(symbol, rule_index, token_index).iteritems():
+                if (end_index not in ends):
+                    ends[end_index] = Struct(symbol=symbol.name, rule_index=rule_index,
+                        children=children)
+
+        return ends
+
+    def parse_symbol(symbol_name, token_index):
+        """
+        Return dict of end token index to tree for the symbol starting at the
+        token index, memoized
+        """
+        key = (symbol_name, token_index)
+        entry = memo.get(key, None)
+        if (entry is not None):
+            if (entry.in_progress):
+                # Left recursion, return the seed and mark the symbols parsed
+                # since the recursive symbol as involved
+                assert None is dbg("left recursion detected", key)
+                entry.left_recursive = True
+                entry.involved.update(stack[stack.index(key)+1:])
+            return entry.ends
+
+        entry = Struct(ends={}, in_progress=True, left_recursive=False, involved=set())
+        memo[key] = entry
+        stack.append(key)
+
+        symbol = symbols[symbol_name]
+        entry.ends = parse_symbol_rules(symbol, token_index)
+        while (entry.left_recursive):
+            # Grow the seed
+            for involved_key in entry.involved:
+                memo.pop(involved_key, None)
+            grown = False
+            for end_index, tree in parse_symbol_rules(symbol, token_index).iteritems():
+                if (end_index not in entry.ends):
+                    entry.ends[end_index] = tree
+                    grown = True
+            if (not grown):
+                break
+        
+        stack.pop()
+        entry.in_progress = False
 
+        assert None is dbg("parsed", symbol_name, "at token[%d]" % token_index, "ends", sorted(entry.ends.keys()))
 
-    # Create a dummy start symbol with the EOF token
-    # XXX Have a way of guaranteeing start, maybe by checking the symbol is not 
-    #     there
+        return entry.ends
 
-    start_symbol = Struct(name="@start", one_of=False, none_of=False, rules=[
-        [Struct(symbol=start_symbol, opt=False), Struct(symbol="", opt=False)]
-    ])
-    # XXX This still doesn't guarantee it doesn't collide with a terminal
-    assert(start_symbol.name not in symbols)
-    # Add the EOF token to the program
-    # XXX Do this in some other way that doesn't require access to the full tokens
-    program_tokens.append("")
-    parser = Struct(
-        tokens=program_tokens, token_index=0, 
-        depth=0, stack=[], failures=set(), success_stack=[]
-    )
+    ends = parse_symbol(start_symbol, 0)
+    tree = ends.get(len(tokens), None)
     
-    res = parse_symbol(parser, start_symbol)
+    if (verbose):
+        print "parsed" if (tree is not None) else "failed to parse", len(tokens), "tokens,", \
+            len(memo), "memo entries"
 
-    return res
+    return tree
     
 
 def test_dfa_scanner(scanner_grammar_filepath, source_filepath, start_symbol):
@@ -1635,6 +2102,8 @@ def test_dfa_scanner(scanner_grammar_filepath, source_filepath, start_symbol):
 
     do_perf = False
     if (do_perf):
+        benchmark_dfa_scanner(dfa, ["_out/pngvalid.c", source_filepath])
+
         import timeit
         t = timeit.Timer(lambda: scan_dfa(dfa, "_out/pngvalid.c"), setup='print("dfa")')
         print(t.timeit(5))
@@ -1668,7 +2137,10 @@ def test_topdown_parser(parser_grammar_filepath, program_tokens, start_symbol):
     # lexer needs to look into semantic to tell between "t * x;" being a pointer
     # declaration o an expression
 
-    parse_top_down(parser_symbols, start_symbol, program_tokens)
+    tree = parse_top_down(parser_symbols, start_symbol, program_tokens)
+    print "parsed" if (tree is not None) else "failed to parse", start_symbol
+
+    return tree
 
 
 def test_regexp_scanner(scanner_symbols, ):
@@ -1694,8 +2166,8 @@ def main():
         # Tests without the need of a tokenizer since the sample program
         # uses tokens directly
 
-        # XXX C99 grammar doesn't work with top down parser because of left
-        #   recursion
+        # C99 grammar works with the packrat top down parser (left recursion
+        # is supported)
         grammar_filepath = "grammars/c99_phrase_structure_grammar.txt"
         sample_program_tokens = (
             "translation-unit",
@@ -1724,7 +2196,7 @@ def main():
             ";",
 
             "return",    # return a;
-            "a",
+            "identifier",
             ";",
 
             "}",
@@ -1732,16 +2204,16 @@ def main():
         )
 
         # Sample grammar to test specific cases
-        grammar_filepath = "tests/test_grammar.txt"
+        grammar_filepath = "tests/grammars/test_grammar.txt"
         # Right recursive works
         # sample_program_tokens = ("right-recursive", ["gh","gh","gh","gh","gh","gh","gh","gh","ef"])
         # Indirect right recursive works
         # sample_program_tokens = ("indirect-right-recursive", ["st", "wx", "st", "wx", "qr"])
         # Function parameters using right recursion works
         #sample_program_tokens = ("function", ["ID", "ID", "(", "ID", "ID", ",", "ID", "ID", ")"])
-        # XXX Left recursive doesn't work 
+        # Left recursive works
         sample_program_tokens = ("left-recursive", ["ab","cd","cd","cd","cd","cd","cd"])
-        # XXX Indirect left recursive doesn't work
+        # Indirect left recursive works
         #sample_program_tokens = ("indirect-left-recursive", ["ij","op","kl","op","kl","op","kl"])
         # Tagging a success as a failure works
         #sample_program_tokens = ("backtrack-success", ["ID", "ID" ])
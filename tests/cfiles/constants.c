@@ -65,3 +65,18 @@ int int_constants() {
         
     ;
 }
+
+int char_constants() {
+    return 
+        'a' + 'Z' + '0' + ' ' +
+        // Simple escapes
+        '\'' + '\"' + '\?' + '\\' + 
+        '\a' + '\b' + '\f' + '\n' + '\r' + '\t' + '\v' +
+        // Octal and hex escapes
+        '\0' + '\101' + '\x41' + '\x7f' +
+        // Chars are signed
+        '\xff' + '\200' +
+        // Wide characters are wchar_t, ie int, escapes are code points
+        L'a' + L'\xff' + L'\u00e9'
+    ;
+}
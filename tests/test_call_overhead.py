@@ -0,0 +1,280 @@
+#!/usr/bin/env python
+"""
+Copyright (C) 2021 Antonio Tejada
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+
+Call overhead benchmark matrix.
+
+Measures the cost of calling an epycc function for every supported parameter
+kind (scalars of each C type, fixed arrays, open arrays, nested arrays,
+structs) times every Python input kind (Python scalars, lists, tuples, numpy,
+ctypes), both through the raw __raw_ ctypes function and through the wrapped
+function.
+
+The functions bodies are trivial so the time measured is dominated by the
+call and parameter marshalling.
+
+Combinations that are not supported (eg the raw function can't take lists, or
+structs are not supported yet) are recorded with their error instead of a time
+so the matrix is complete and it's visible when a combination starts working.
+
+Results are written in machine readable form to _out/call_overhead.json and
+_out/call_overhead.csv so different marshalling implementations can be diffed.
+
+Usage
+    test_call_overhead.py [--reps N] [--number N] [--out-prefix PATH]
+"""
+
+import argparse
+import csv
+import ctypes
+import gc
+import json
+import os
+import platform
+import sys
+import timeit
+
+try:
+    import numpy as np
+except ImportError:
+    np = None
+
+# Add the parent dir to syspath to be able to import epycc
+epycc_dirpath = os.path.dirname(os.path.dirname(os.path.abspath(__file__)))
+sys.path.append(epycc_dirpath)
+import epycc
+
+# Length of the arrays passed, small enough for the call overhead to dominate
+# but not so small that per element conversion costs are hidden
+array_len = 16
+nested_len = 4
+
+def get_c_identifier(c_type):
+    return c_type.replace(" ", "_")
+
+def get_scalar_value(c_type):
+    if (c_type in epycc.float_types):
+        return 3.0
+    elif (c_type == "_Bool"):
+        return True
+    elif (c_type == "char"):
+        # ctypes c_char only accepts one character strings
+        return "a"
+    else:
+        return 3
+
+def build_sources():
+    """
+    Return a list of Struct(name, kind, c_type, source) with one C function
+    per parameter kind.
+
+    Each kind is compiled in its own source so a kind that fails to compile
+    (eg structs) doesn't prevent measuring the others.
+    """
+    sources = []
+
+    sources.append(epycc.Struct(name="empty", kind="none", c_type="void",
+        source="void empty() { }"))
+
+    for c_type in sorted(epycc.non_void_types):
+        name = "scalar_%s" % get_c_identifier(c_type)
+        sources.append(epycc.Struct(name=name, kind="scalar", c_type=c_type,
+            source="%s %s(%s a) { return a; }" % (c_type, name, c_type)))
+
+    sources.extend([
+        epycc.Struct(name="fixed_array", kind="fixed_array", c_type="float",
+            source="float fixed_array(float a[%d]) { return a[0]; }" % array_len),
+        epycc.Struct(name="open_array", kind="open_array", c_type="float",
+            source="float open_array(float a[], int count) { return a[0]; }"),
+        epycc.Struct(name="nested_array", kind="nested_array", c_type="float",
+            source="float nested_array(float a[%d][%d]) { return a[0][0]; }" % (nested_len, nested_len)),
+        epycc.Struct(name="open_nested_array", kind="open_nested_array", c_type="float",
+            source="float open_nested_array(float a[][%d], int count) { return a[0][0]; }" % nested_len),
+        epycc.Struct(name="struct_param", kind="struct", c_type="struct s",
+            source="struct s { int i; float f; };\nint struct_param(struct s a) { return a.i; }"),
+    ])
+
+    return sources
+
+def build_inputs(entry, raw_cfunc):
+    """
+    Return a list of (input_kind, args) for the given function.
+
+    raw_cfunc is used to build the ctypes inputs with the exact ctypes the
+    function was compiled with, can be None if the function failed to compile
+    """
+    inputs = []
+    if (entry.kind == "none"):
+        inputs.append(("none", ()))
+
+    elif (entry.kind == "scalar"):
+        value = get_scalar_value(entry.c_type)
+        inputs.append(("python", (value,)))
+        if (raw_cfunc is not None):
+            inputs.append(("ctypes", (raw_cfunc.argtypes[0](value),)))
+        if (np is not None):
+            ctype = epycc.get_ctype(entry.c_type)
+            inputs.append(("numpy", (np.array([value], dtype=np.dtype(ctype))[0],)))
+
+    elif (entry.kind == "struct"):
+        inputs.append(("python", ((1, 2.0),)))
+        if (raw_cfunc is not None):
+            inputs.append(("ctypes", (raw_cfunc.argtypes[0](1, 2.0),)))
+
+    else:
+        if (entry.kind in ["nested_array", "open_nested_array"]):
+            l = [[float(i * nested_len + j) for j in xrange(nested_len)] for i in xrange(nested_len)]
+            t = tuple([tuple(row) for row in l])
+        else:
+            l = [float(i) for i in xrange(array_len)]
+            t = tuple(l)
+
+        # Open arrays take an extra count parameter
+        extra = (len(l), ) if entry.kind.startswith("open") else ()
+
+        inputs.append(("list", (l, ) + extra))
+        inputs.append(("tuple", (t, ) + extra))
+        if (np is not None):
+            inputs.append(("numpy", (np.array(l, np.float32), ) + extra))
+        if (raw_cfunc is not None):
+            # Note the ctypes input is prepared outside of the timed call, as
+            # callers doing repeated calls would do
+            ctype = raw_cfunc.argtypes[0]
+            if (entry.kind in ["nested_array", "open_nested_array"]):
+                row_ctype = ctype._type_
+                c_arr = (row_ctype * len(l))(*[row_ctype(*row) for row in l])
+            else:
+                c_arr = (ctype._type_ * len(l))(*l)
+            inputs.append(("ctypes", (ctypes.cast(c_arr, ctype), ) + extra))
+            if (np is not None):
+                np_arr = np.array(l, np.float32)
+                inputs.append(("numpy_ctypes", (np_arr.ctypes.data_as(ctype), ) + extra))
+
+    return inputs
+
+def time_call(fn, args, number, reps):
+    """
+    Return the list of per call times in seconds, one per rep, or raise if the
+    call fails
+    """
+    # Warm up and fail early if the combination is not supported
+    fn(*args)
+
+    timer = timeit.Timer(lambda: fn(*args))
+    gc_enabled = gc.isenabled()
+    gc.disable()
+    try:
+        times = timer.repeat(repeat=reps, number=number)
+    finally:
+        if (gc_enabled):
+            gc.enable()
+
+    return [t / number for t in times]
+
+def run_matrix(number, reps):
+    results = []
+    for entry in build_sources():
+        lib = None
+        compile_error = None
+        try:
+            lib = epycc.epycc_compile(entry.source)
+        except Exception as e:
+            compile_error = "%s: %s" % (type(e).__name__, e)
+
+        raw_cfunc = None
+        if (lib is not None):
+            raw_cfunc = getattr(lib, "__raw_" + entry.name)
+
+        for input_kind, args in build_inputs(entry, raw_cfunc):
+            for call_kind in ["raw", "wrapped"]:
+                result = dict(
+                    function=entry.name,
+                    param_kind=entry.kind,
+                    c_type=entry.c_type,
+                    input_kind=input_kind,
+                    call_kind=call_kind,
+                    status="ok",
+                    min_us=None,
+                    mean_us=None,
+                )
+                if (lib is None):
+                    result["status"] = "unsupported: %s" % compile_error
+
+                else:
+                    if (call_kind == "raw"):
+                        fn = raw_cfunc
+                    else:
+                        fn = getattr(lib, entry.name)
+
+                    try:
+                        times = time_call(fn, args, number, reps)
+                        result["min_us"] = min(times) * 1e6
+                        result["mean_us"] = (sum(times) / len(times)) * 1e6
+                    except Exception as e:
+                        result["status"] = "unsupported: %s: %s" % (type(e).__name__, e)
+
+                print "%-20s %-14s %-8s %-8s %s" % (
+                    entry.name, input_kind, call_kind,
+                    "%.3f" % result["min_us"] if (result["min_us"] is not None) else "-",
+                    result["status"])
+                results.append(result)
+
+    return results
+
+def write_results(results, out_prefix, number, reps):
+    out_dirpath = os.path.dirname(os.path.abspath(out_prefix))
+    if (not os.path.exists(out_dirpath)):
+        os.makedirs(out_dirpath)
+
+    header = ["function", "param_kind", "c_type", "input_kind", "call_kind",
+        "status", "min_us", "mean_us"]
+
+    with open(out_prefix + ".json", "w") as f:
+        json.dump(dict(
+            platform=platform.platform(),
+            python=platform.python_version(),
+            numpy=np.__version__ if (np is not None) else None,
+            number=number,
+            reps=reps,
+            results=results,
+        ), f, indent=2, sort_keys=True)
+
+    with open(out_prefix + ".csv", "wb") as f:
+        writer = csv.writer(f)
+        writer.writerow(header)
+        for result in results:
+            writer.writerow([result[key] if (result[key] is not None) else "" for key in header])
+
+def main():
+    parser = argparse.ArgumentParser(description="epycc call overhead benchmark matrix")
+    parser.add_argument("--reps", type=int, default=5,
+        help="number of timing repetitions, the minimum is reported")
+    parser.add_argument("--number", type=int, default=10000,
+        help="number of calls per repetition")
+    parser.add_argument("--out-prefix", default=os.path.join(epycc_dirpath, "_out", "call_overhead"),
+        help="path prefix of the .json and .csv result files")
+    args = parser.parse_args()
+
+    results = run_matrix(args.number, args.reps)
+    write_results(results, args.out_prefix, args.number, args.reps)
+
+    num_ok = len([r for r in results if r["status"] == "ok"])
+    print "%d combinations, %d supported, results in %s.{json,csv}" % (
+        len(results), num_ok, args.out_prefix)
+
+if (__name__ == "__main__"):
+    main()
@@ -2,6 +2,22 @@
 """
 Test all the .c files in the cfiles dir
 
+Run with --benchmark to compile the .c files with both epycc and clang -O2 into
+shared objects and compare the runtime of each function instead of the IR,
+functions where epycc code is measurably slower are flagged. Results are
+written to _out/cfiles_runtime.csv
+
+Run with --parallel or --jobs N to compile and validate the files across a pool
+of N processes (default the number of cpus). Files are split in 1000-line chunks
+which are compiled in parallel, the results and output are merged in file order
+so they are the same as a serial run. Compiled chunks are cached in _out/cache
+keyed by the hash of the chunk source, of epycc (including its grammars and
+generated files) and of the llvmlite version, run with --no-cache to disable
+the cache. Serial runs only use the cache when run with --cache.
+
+Files are compiled with the default (non-streaming) parser, run with
+--streaming to compile them in streaming mode instead.
+
 Generating gold file with clang
 ===============================
 
@@ -290,11 +306,16 @@ epycc
     }
 
 """
+import ctypes
+import hashlib
+import multiprocessing
 import os
 import re
 import string
+import StringIO
 import sys
 import time
+import timeit
 import traceback
 
 
@@ -302,22 +323,34 @@ import traceback
 epycc_dirpath = os.path.dirname(os.path.dirname(os.path.abspath(__file__)))
 sys.path.append(epycc_dirpath)
 import epycc
+import llvmlite
 
-def test_single_cfile(test_filepath, ignore_existing_files=False):
-    print "testing", os.path.split(test_filepath)[1]
+out_dir = os.path.join(epycc_dirpath, "_out")
+gold_dir = os.path.join(epycc_dirpath, "_out")
+cache_dir = os.path.join(epycc_dirpath, "_out", "cache")
 
-    sys.stdout.flush()
-    
-    out_dir = os.path.join(epycc_dirpath, "_out")
-    gold_dir = os.path.join(epycc_dirpath, "_out")
+# Invoke epycc in file chunks, otherwise the Lark Early parser errors with stack
+# overflow with a file with thousands of lines (it's also possible that it 
+# reduces the parsing time, but seems to be in the noise, parsing hovers around
+# 13 lines/sec). The LALR parser in streaming mode doesn't need chunking, but
+# chunks are still the unit of work when multiprocessing and caching the test
+lines_per_compile = 1000
 
+def get_cfile_filepaths(test_filepath):
     _, test_filename = os.path.split(test_filepath)
-    test_ir_filepath = os.path.join(out_dir, test_filename + ".ll")
-    test_optimized_ir_filepath = os.path.join(out_dir, test_filename + ".optimized.ll")
 
     gold_filename = "gold_" + test_filename
-    gold_ir_filepath = os.path.join(gold_dir, gold_filename + ".ll")
-    gold_optimized_ir_filepath = os.path.join(gold_dir, gold_filename + ".optimized.ll")
+
+    return epycc.Struct(
+        test_ir = os.path.join(out_dir, test_filename + ".ll"),
+        test_optimized_ir = os.path.join(out_dir, test_filename + ".optimized.ll"),
+        gold_ir = os.path.join(gold_dir, gold_filename + ".ll"),
+        gold_optimized_ir = os.path.join(gold_dir, gold_filename + ".optimized.ll"),
+    )
+
+def generate_gold_files(test_filepath, ignore_existing_files=False):
+    filepaths = get_cfile_filepaths(test_filepath)
+    gold_optimized_ir_filepath = filepaths.gold_optimized_ir
 
     #  If the gold IR file already exists, no need to generate it from clang
     if (ignore_existing_files or (not os.path.exists(gold_optimized_ir_filepath)) or 
@@ -328,41 +361,123 @@ def test_single_cfile(test_filepath, ignore_existing_files=False):
         # - compiling with clang
         # - running epycc before the change and copying from out to golden (this assumes
         #   a fresh repo passes the tests)
-        epycc.invoke_clang(test_filepath, gold_ir_filepath)
+        epycc.invoke_clang(test_filepath, filepaths.gold_ir)
         # XXX Disable loop unrolling and vectorization to match what epycc produces
         #     and make comparing results easier. This should be enabled on epycc and
         #     re-enabled here. See the test function ffact where both affect the 
         #     generated code
         epycc.invoke_clang(test_filepath, gold_optimized_ir_filepath, "-O2 -fno-unroll-loops -fno-vectorize")
-    
-
-    # Compile with epycc
 
-    # Invoke epycc in file chunks, otherwise the Lark Early parser errors with stack
-    # overflow with a file with thousands of lines (it's also possible that it 
-    # reduces the parsing time, but seems to be in the noise, parsing hovers around
-    # 13 lines/sec)
-    # XXX This can also be used to multiprocess the test
+def split_cfile_chunks(test_filepath):
+    """
+    Return the list of source chunks of the file to compile, each chunk is
+    lines_per_compile lines long (except the first one, which is one line
+    shorter, and the last one)
+    """
+    chunks = []
     i = 1
-    lines_per_compile = 1000
     s = ""
-    with open(test_filepath, "r") as f, open(test_ir_filepath, "w") as f2, open(test_optimized_ir_filepath, "w") as f3:
-        
-        start_time = time.time()
+    with open(test_filepath, "r") as f:
         l = None
         while (l != ""):
             l = f.readline()
             if ((i % lines_per_compile == 0) or ((l == "") and (s != ""))):
-                # XXX For hand-gilded tests we don't need optimized versions and we
-                #     could just generate IR without compiling?
-                lib = epycc.epycc_compile(s)
-                f2.write(lib.ir)
-                f3.write(lib.ir_optimized)
-                print i, i * 1.0 / (time.time() - start_time), "lines/sec"
+                chunks.append(s)
                 s = ""
             s += l
             i += 1
 
+    return chunks
+
+epycc_hash = None
+def get_chunk_cache_key(chunk, streaming=False):
+    """
+    The compiled chunk depends on the chunk source and on the compiler, key
+    the cache on both so editing epycc, the grammars, the snippets IR or
+    updating llvmlite invalidates the cache
+    """
+    global epycc_hash
+    if (epycc_hash is None):
+        h = hashlib.sha1()
+        filepaths = [os.path.join(epycc_dirpath, filename) for filename in ["epycc.py", "grammar.py"]]
+        for dirname in ["grammars", "generated"]:
+            dirpath = os.path.join(epycc_dirpath, dirname)
+            filepaths.extend([os.path.join(dirpath, filename) for filename in sorted(os.listdir(dirpath))])
+        for filepath in filepaths:
+            h.update(os.path.relpath(filepath, epycc_dirpath))
+            with open(filepath, "rb") as f:
+                h.update(f.read())
+        h.update(llvmlite.__version__)
+        h.update(str(epycc.llvm.llvm_version_info))
+        epycc_hash = h.hexdigest()
+
+    return hashlib.sha1(epycc_hash + ("streaming" if streaming else "") + chunk).hexdigest()
+
+def compile_chunk(chunk, use_cache=True, streaming=False):
+    """
+    Compile the chunk with epycc and return (ir, ir_optimized), using the
+    compile cache if enabled.
+
+    This is a module function so it can be sent to process pool workers
+    """
+    cache_filepath = None
+    if (use_cache):
+        cache_filepath = os.path.join(cache_dir, get_chunk_cache_key(chunk, streaming))
+        if (os.path.exists(cache_filepath + ".optimized.ll")):
+            with open(cache_filepath + ".ll", "r") as f:
+                ir = f.read()
+            with open(cache_filepath + ".optimized.ll", "r") as f:
+                ir_optimized = f.read()
+
+            return ir, ir_optimized
+
+    # XXX For hand-gilded tests we don't need optimized versions and we
+    #     could just generate IR without compiling?
+    lib = epycc.epycc_compile(chunk, streaming=streaming)
+
+    if (use_cache):
+        if (not os.path.exists(cache_dir)):
+            try:
+                os.makedirs(cache_dir)
+            except OSError:
+                # Another worker may have created it in the meantime
+                pass
+        # Write the optimized file last since it's the one checked for
+        # presence, write to temporary files and rename so other workers never
+        # see partially written files
+        for ext, ir in [(".ll", lib.ir), (".optimized.ll", lib.ir_optimized)]:
+            tmp_filepath = "%s.%d.tmp" % (cache_filepath, os.getpid())
+            with open(tmp_filepath, "w") as f:
+                f.write(ir)
+            try:
+                # Atomic replace on POSIX, readers see either the old or the
+                # new file
+                os.rename(tmp_filepath, cache_filepath + ext)
+            except OSError:
+                # Windows can't rename over an existing file, if another
+                # worker already wrote it, the contents are the same
+                os.remove(tmp_filepath)
+                if (not os.path.exists(cache_filepath + ext)):
+                    raise
+
+    return lib.ir, lib.ir_optimized
+
+def write_cfile_irs(test_filepath, chunk_irs):
+    filepaths = get_cfile_filepaths(test_filepath)
+    with open(filepaths.test_ir, "w") as f2, open(filepaths.test_optimized_ir, "w") as f3:
+        for ir, ir_optimized in chunk_irs:
+            f2.write(ir)
+            f3.write(ir_optimized)
+
+def validate_cfile(test_filepath):
+    """
+    Compare the epycc and gold optimized IR files for the C file, return the
+    number of unexpected mismatches
+    """
+    filepaths = get_cfile_filepaths(test_filepath)
+    test_optimized_ir_filepath = filepaths.test_optimized_ir
+    gold_optimized_ir_filepath = filepaths.gold_optimized_ir
+
     epycc_ir = epycc.load_functions_ir(test_optimized_ir_filepath)
     gold_ir = epycc.load_functions_ir(gold_optimized_ir_filepath)
 
@@ -412,6 +527,288 @@ def test_single_cfile(test_filepath, ignore_existing_files=False):
 
     return unexpected_mismatch_count
 
+def test_single_cfile(test_filepath, ignore_existing_files=False, use_cache=False, streaming=False):
+    print "testing", os.path.split(test_filepath)[1]
+
+    sys.stdout.flush()
+    
+    generate_gold_files(test_filepath, ignore_existing_files)
+
+    # Compile with epycc
+    start_time = time.time()
+    chunk_irs = []
+    i = 0
+    for chunk in split_cfile_chunks(test_filepath):
+        chunk_irs.append(compile_chunk(chunk, use_cache, streaming))
+        i += chunk.count("\n")
+        print i, i * 1.0 / (time.time() - start_time), "lines/sec"
+    write_cfile_irs(test_filepath, chunk_irs)
+
+    return validate_cfile(test_filepath)
+
+
+def capture_output(fn, *args):
+    """
+    Call fn with stdout redirected to a string, return (result, output).
+
+    Exceptions are printed to the output and returned as None result, so a
+    failing file doesn't abort the pool
+    """
+    old_stdout = sys.stdout
+    old_stderr = sys.stderr
+    sys.stdout = sys.stderr = StringIO.StringIO()
+    result = None
+    try:
+        result = fn(*args)
+    except Exception as e:
+        traceback.print_exc()
+    finally:
+        output = sys.stdout.getvalue()
+        sys.stdout = old_stdout
+        sys.stderr = old_stderr
+
+    return result, output
+
+def pool_generate_gold_files(args):
+    return capture_output(generate_gold_files, *args)
+
+def pool_compile_chunk(args):
+    return capture_output(compile_chunk, *args)
+
+def pool_validate_cfile(test_filepath):
+    return capture_output(validate_cfile, test_filepath)
+
+def test_cfiles(cfiles_dirpath, jobs=None, ignore_existing_files=False, use_cache=True, streaming=False):
+    """
+    Compile and validate all the C files in the directory across a pool of
+    processes.
+
+    Work is distributed per source chunk for compiling and per file for gold
+    generation and validation. Results and the output of each file are merged
+    in file and chunk order so the output is deterministic regardless of the
+    number of processes.
+
+    Returns the number of files that failed
+    """
+    test_filepaths = []
+    for (dirpath, dirnames, filenames) in os.walk(cfiles_dirpath):
+        for test_filename in sorted(filenames):
+            if (test_filename.endswith(".c")):
+                test_filepaths.append(os.path.join(dirpath, test_filename))
+
+    pool = multiprocessing.Pool(jobs)
+    try:
+        start_time = time.time()
+        gold_results = pool.map(pool_generate_gold_files, 
+            [(test_filepath, ignore_existing_files) for test_filepath in test_filepaths])
+
+        # Flatten all the chunks of all the files so big files are split across
+        # workers, map returns the results in order
+        file_chunks = [split_cfile_chunks(test_filepath) for test_filepath in test_filepaths]
+        chunk_results = pool.map(pool_compile_chunk, 
+            [(chunk, use_cache, streaming) for chunks in file_chunks for chunk in chunks], chunksize=1)
+        line_count = sum([chunk.count("\n") for chunks in file_chunks for chunk in chunks])
+        print "Compiled", line_count, "lines in", time.time() - start_time, "secs"
+
+        failures = 0
+        chunk_index = 0
+        compiled_filepaths = []
+        for test_filepath, chunks, gold_result in zip(test_filepaths, file_chunks, gold_results):
+            _, gold_output = gold_result
+            chunk_irs = []
+            compile_output = gold_output
+            for chunk_ir, output in chunk_results[chunk_index:chunk_index + len(chunks)]:
+                chunk_irs.append(chunk_ir)
+                compile_output += output
+            chunk_index += len(chunks)
+
+            if (any([chunk_ir is None for chunk_ir in chunk_irs])):
+                print "testing", os.path.split(test_filepath)[1]
+                print compile_output,
+                failures += 1
+                
+            else:
+                write_cfile_irs(test_filepath, chunk_irs)
+                compiled_filepaths.append((test_filepath, compile_output))
+        
+        validate_results = pool.map(pool_validate_cfile, 
+            [test_filepath for test_filepath, _ in compiled_filepaths], chunksize=1)
+
+        for (test_filepath, compile_output), (unexpected_mismatch_count, output) in zip(compiled_filepaths, validate_results):
+            print "testing", os.path.split(test_filepath)[1]
+            print compile_output + output,
+            if (unexpected_mismatch_count != 0):
+                failures += 1
+
+    finally:
+        pool.close()
+        pool.join()
+
+    print "Tested", len(test_filepaths), "files in", time.time() - start_time, "secs,", failures, "failed"
+
+    return failures
+
+
+def get_benchmark_scalar(ctype, value):
+    if (ctype is ctypes.c_char):
+        return chr(value % 128)
+
+    elif (ctype in [ctypes.c_float, ctypes.c_double, ctypes.c_longdouble]):
+        return float(value)
+
+    elif (ctype is ctypes.c_bool):
+        return bool(value)
+
+    else:
+        return value
+
+def build_benchmark_args(argtypes, value):
+    """
+    Generate ctypes arguments for the given argtypes, using value for all the
+    scalars and for filling arrays.
+
+    Arrays are passed as pointers to a buffer big enough for the indexing done
+    by the tests when the scalar parameters are set to value (the outermost
+    dimension of array parameters is lost when they decay to pointers)
+    """
+    def fill(c_arr, scalar):
+        for i in xrange(len(c_arr)):
+            if (isinstance(c_arr[i], ctypes.Array)):
+                fill(c_arr[i], scalar)
+            else:
+                c_arr[i] = scalar
+
+    buffer_len = max(64, value + 1)
+    args = []
+    for argtype in argtypes:
+        if (issubclass(argtype, ctypes._Pointer)):
+            item_ctype = argtype._type_
+            leaf_ctype = item_ctype
+            while (issubclass(leaf_ctype, ctypes.Array)):
+                leaf_ctype = leaf_ctype._type_
+
+            c_arr = (item_ctype * buffer_len)()
+            fill(c_arr, get_benchmark_scalar(leaf_ctype, value))
+            # Note cast keeps a reference to c_arr so it's not freed
+            args.append(ctypes.cast(c_arr, argtype))
+
+        else:
+            args.append(argtype(get_benchmark_scalar(argtype, value)))
+
+    return args
+
+def time_cfunc(cfunc, args, number = 1000, reps = 5):
+    """
+    Return the minimum time per call in seconds
+    """
+    timer = timeit.Timer(lambda: cfunc(*args))
+    return min(timer.repeat(repeat=reps, number=number)) / number
+
+def prototype_uses_long(prototype):
+    """
+    Return True if the C prototype has long (but not long long) parameters or
+    result
+    """
+    tokens = prototype.split()
+    for i, token in enumerate(tokens):
+        if ((token == "long") and 
+            ((i == 0) or (tokens[i - 1] != "long")) and 
+            ((i + 1 == len(tokens)) or (tokens[i + 1] != "long"))):
+            return True
+
+    return False
+
+def benchmark_single_cfile(test_filepath, value = 10, tolerance = 0.10, min_diff = 5e-9):
+    """
+    Compile the C file with epycc and with clang -O2 into a shared object, run
+    every function from both with the same generated inputs and report the
+    runtime ratio epycc / clang.
+
+    Functions where epycc is slower than clang by more than tolerance (ratio)
+    and min_diff (seconds per call, to filter out noise in functions that are
+    dominated by the call overhead) are flagged.
+
+    Both versions are invoked through ctypes functions with the same argtypes
+    so the call overhead is the same for both and the difference comes from
+    the generated code.
+
+    Note clang targets the host ABI, so on LP64 hosts functions with long
+    parameters or results (32-bit in epycc, 64-bit in clang) are not
+    comparable and are skipped, see prototype_uses_long.
+
+    Returns the list of Struct(name, epycc_time, clang_time, ratio, slower)
+    """
+    print "benchmarking", os.path.split(test_filepath)[1]
+
+    out_dir = os.path.join(epycc_dirpath, "_out")
+    _, test_filename = os.path.split(test_filepath)
+    so_filepath = os.path.join(out_dir, test_filename + ".so")
+
+    exit_code = epycc.invoke_clang_shared(test_filepath, so_filepath, "-O2")
+    assert exit_code == 0, "clang failed compiling %s" % test_filepath
+    clang_lib = ctypes.CDLL(so_filepath)
+
+    with open(test_filepath, "r") as f:
+        lib = epycc.epycc_compile(f.read())
+
+    # Only the functions in the file have __raw_ entries, not the snippets
+    results = []
+    prototypes = dict([(function_signature.name, function_signature.prototype) 
+        for function_signature in lib.function_signatures])
+    for fn_name in sorted([attr[len("__raw_"):] for attr in dir(lib) if attr.startswith("__raw_")]):
+        raw_cfunc = getattr(lib, "__raw_" + fn_name)
+
+        if ((ctypes.sizeof(ctypes.c_long) != 4) and prototype_uses_long(prototypes[fn_name])):
+            print "%-40s skipped, long is 64-bit in clang" % fn_name
+            continue
+
+        clang_cfunc = ctypes.CFUNCTYPE(raw_cfunc.restype, *raw_cfunc.argtypes)(
+            ctypes.cast(getattr(clang_lib, fn_name), ctypes.c_void_p).value)
+
+        args = build_benchmark_args(raw_cfunc.argtypes, value)
+        epycc_time = time_cfunc(raw_cfunc, args)
+        clang_time = time_cfunc(clang_cfunc, args)
+
+        ratio = epycc_time / clang_time
+        slower = (ratio > (1.0 + tolerance)) and ((epycc_time - clang_time) > min_diff)
+
+        print "%-40s epycc %10.1fns clang %10.1fns ratio %5.2f%s" % (
+            fn_name, epycc_time * 1e9, clang_time * 1e9, ratio,
+            " SLOWER" if slower else "")
+
+        results.append(epycc.Struct(name=fn_name, epycc_time=epycc_time,
+            clang_time=clang_time, ratio=ratio, slower=slower))
+
+    return results
+
+def benchmark_cfiles(cfiles_dirpath):
+    results = []
+    for (dirpath, dirnames, filenames) in os.walk(cfiles_dirpath):
+        for test_filename in sorted(filenames):
+            if (test_filename.endswith(".c")):
+                test_filepath = os.path.join(dirpath, test_filename)
+                try:
+                    for result in benchmark_single_cfile(test_filepath):
+                        result.filename = test_filename
+                        results.append(result)
+                except Exception as e:
+                    traceback.print_exc()
+
+    csv_filepath = os.path.join(epycc_dirpath, "_out", "cfiles_runtime.csv")
+    with open(csv_filepath, "w") as f:
+        f.write("file,function,epycc_ns,clang_ns,ratio,slower\n")
+        for result in results:
+            f.write("%s,%s,%f,%f,%f,%d\n" % (result.filename, result.name,
+                result.epycc_time * 1e9, result.clang_time * 1e9, result.ratio,
+                result.slower))
+
+    slower = [result for result in results if result.slower]
+    print "Benchmarked", len(results), "functions,", len(slower), "slower than clang, results in", csv_filepath
+    for result in slower:
+        print "   ", result.filename, result.name, "%.2f" % result.ratio
+
+    return results
+
 
 if (__name__ == "__main__"):
     ignore_existing_files = False
@@ -423,14 +820,32 @@ if (__name__ == "__main__"):
     sys.stderr = sys.stdout
 
     cfiles_dirpath = os.path.join(os.path.dirname(os.path.abspath(__file__)), "cfiles")
+
+    # Runtime comparison against clang -O2 instead of IR comparison
+    if ("--benchmark" in sys.argv[1:]):
+        benchmark_cfiles(cfiles_dirpath)
+        sys.exit(0)
+
+    # Compile and validate across a process pool, --jobs N to set the number
+    # of processes (defaults to the number of cpus), --no-cache to disable the
+    # compile cache. Serial runs only use the compile cache with --cache
+    jobs = None
+    if ("--jobs" in sys.argv[1:]):
+        jobs = int(sys.argv[sys.argv.index("--jobs") + 1])
+        
+    if ((jobs is not None) and (jobs != 1)) or ("--parallel" in sys.argv[1:]):
+        failures = test_cfiles(cfiles_dirpath, jobs, ignore_existing_files, 
+            "--no-cache" not in sys.argv[1:], "--streaming" in sys.argv[1:])
+        sys.exit(1 if (failures > 0) else 0)
+
     for (dirpath, dirnames, filenames) in os.walk(cfiles_dirpath):
         for test_filename in filenames:
             try:
                 if (test_filename.endswith(".c")):
                     test_filepath = os.path.join(dirpath, test_filename)
 
-                    unexpected_mismatch_count = test_single_cfile(test_filepath, ignore_existing_files)
+                    unexpected_mismatch_count = test_single_cfile(test_filepath, 
+                        ignore_existing_files, "--cache" in sys.argv[1:], "--streaming" in sys.argv[1:])
                     assert(unexpected_mismatch_count == 0)
             except Exception as e:
                 traceback.print_exc()
-
@@ -0,0 +1,118 @@
+#!/usr/bin/env python
+"""
+Copyright (C) 2021 Antonio Tejada
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+
+Test the DFA construction, minimization and table driven scanning in
+grammar.py on the C99 lexical grammar
+"""
+import glob
+import json
+import os
+import subprocess
+import sys
+import traceback
+
+# Add the parent dir to syspath to be able to import grammar
+epycc_dirpath = os.path.dirname(os.path.dirname(os.path.abspath(__file__)))
+sys.path.append(epycc_dirpath)
+import grammar
+
+lexical_grammar_filepath = os.path.join(epycc_dirpath, "grammars", "c99_lexical_grammar.txt")
+cfiles_filepaths = sorted(glob.glob(os.path.join(epycc_dirpath, "tests", "cfiles", "*.c")))
+
+# The DFAs take a while to build, share them between tests
+lexer_dfas = dict()
+
+def get_lexer_dfa(minimize):
+    dfa = lexer_dfas.get(minimize, None)
+    if (dfa is None):
+        verbose = grammar.verbose
+        grammar.verbose = False
+        try:
+            dfa = grammar.build_lexer_dfa(lexical_grammar_filepath,
+                grammar.c99_lexer_token_kinds, minimize)
+        finally:
+            grammar.verbose = verbose
+        lexer_dfas[minimize] = dfa
+
+    return dfa
+
+def test_minimize_dfa():
+    tables = grammar.build_dfa_tables(get_lexer_dfa(False))
+    minimized_tables = grammar.build_dfa_tables(get_lexer_dfa(True))
+    assert minimized_tables.num_states < tables.num_states
+
+    # The minimized DFA scans the same tokens as the unminimized one
+    for filepath in cfiles_filepaths:
+        with open(filepath, "rb") as f:
+            data = f.read()
+        assert (list(grammar.scan_dfa_tables(tables, data)) ==
+            list(grammar.scan_dfa_tables(minimized_tables, data))), "Scanners mismatch on %s" % filepath
+
+    # Minimizing a minimal DFA returns the same DFA
+    assert (grammar.build_dfa_tables(grammar.minimize_dfa(get_lexer_dfa(True))).__dict__ ==
+        minimized_tables.__dict__)
+
+def test_minimize_dfa_deterministic():
+    # The DFA state names and transition orders depend on the hash seed,
+    # the minimized DFA must not
+    script = "\n".join([
+        "import json, sys",
+        "sys.path.append(%r)" % epycc_dirpath,
+        "import grammar",
+        "grammar.verbose = False",
+        "tables = grammar.build_lexer_tables(%r, grammar.c99_lexer_token_kinds)" % lexical_grammar_filepath,
+        "print json.dumps(tables.__dict__, sort_keys=True)",
+    ])
+    all_tables = []
+    for hash_seed in ["1", "2", "3"]:
+        env = dict(os.environ)
+        env["PYTHONHASHSEED"] = hash_seed
+        output = subprocess.check_output([sys.executable, "-c", script], env=env)
+        all_tables.append(json.loads(output))
+
+    assert all_tables[0] == all_tables[1] == all_tables[2]
+    assert all_tables[0]["num_states"] == grammar.build_dfa_tables(get_lexer_dfa(True)).num_states
+
+def test_scan_dfa_tables_chunks():
+    tables = grammar.build_dfa_tables(get_lexer_dfa(True))
+    filepath = os.path.join(epycc_dirpath, "tests", "cfiles", "constants.c")
+    with open(filepath, "rb") as f:
+        data = f.read()
+    tokens = list(grammar.scan_dfa_tables(tables, data))
+    # Tokens spanning several chunks are scanned the same, including tokens
+    # longer than a chunk (eg comments)
+    for chunk_size in [1, 7, 64]:
+        assert list(grammar.scan_dfa_tables(tables, data, chunk_size)) == tokens
+    assert list(grammar.scan_dfa_tables_file(tables, filepath)) == tokens
+    assert list(grammar.scan_dfa_tables(tables, "")) == []
+
+
+if (__name__ == "__main__"):
+    sys.stderr = sys.stdout
+
+    failures = 0
+    tests = [(name, fn) for name, fn in sorted(globals().items()) if name.startswith("test_")]
+    for name, fn in tests:
+        print "testing", name
+        try:
+            fn()
+        except Exception as e:
+            traceback.print_exc()
+            failures += 1
+
+    print "Ran", len(tests), "tests,", failures, "failures"
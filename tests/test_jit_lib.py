@@ -0,0 +1,819 @@
+#!/usr/bin/env python
+"""
+Copyright (C) 2021 Antonio Tejada
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+
+Test the runtime features of the jit_lib returned by epycc_compile (as opposed
+to the code generation, which is tested by test_cfiles.py)
+"""
+import cPickle
+import ctypes
+import mmap
+import multiprocessing.sharedctypes
+import os
+import sys
+import threading
+import traceback
+
+# Add the parent dir to syspath to be able to import epycc
+epycc_dirpath = os.path.dirname(os.path.dirname(os.path.abspath(__file__)))
+sys.path.append(epycc_dirpath)
+import epycc
+import epyccd
+import epyccrt
+
+source = """
+int fsum(int a) {
+    int s = 0;
+    for (int i = 0; i < a; ++i) {
+        if (i > 5) {
+            s += i;
+        }
+    }
+    return s;
+}
+"""
+
+def test_compile_async():
+    futures = [epycc.compile_async(source, streaming=(i % 2 == 0)) for i in xrange(4)]
+    for future in futures:
+        lib = future.result()
+        assert lib.fsum(10) == sum([i for i in xrange(10) if i > 5])
+        lib.close()
+
+    # Any compilation exception is fine, check outside of the try so the
+    # assert isn't caught
+    future = epycc.compile_async("int f() { return undeclared; }")
+    raised = False
+    try:
+        future.result()
+    except Exception:
+        raised = True
+    assert raised, "Compilation error didn't raise"
+
+    # Linked libraries can't be sent to the workers
+    lib = epycc.epycc_compile(source)
+    raised = False
+    try:
+        epycc.compile_async("float f(int n) { return fsum(n); }", libs=[lib])
+    except ValueError:
+        raised = True
+    assert raised, "compile_async with libs didn't raise"
+    lib.close()
+
+    epycc.close_compile_pool()
+
+def test_compile_threads():
+    # Compile from multiple threads at the same time, exercising the per
+    # thread parsers
+    results = dict()
+    def compile_thread(i):
+        lib = epycc.epycc_compile(source.replace("i > 5", "i > %d" % i), streaming=True, 
+            self_hosted_lexer=(i % 2 == 0))
+        results[i] = lib.fsum(10)
+
+    threads = [threading.Thread(target=compile_thread, args=(i,)) for i in xrange(4)]
+    for thread in threads:
+        thread.start()
+    for thread in threads:
+        thread.join()
+    assert results == dict([(i, sum([j for j in xrange(10) if j > i])) for i in xrange(4)])
+
+def test_compile_server():
+    socket_path = os.path.join(epycc_dirpath, "_out", "test_epyccd.sock")
+    server = epyccd.CompileServer(socket_path, 1024 * 1024)
+    server_thread = threading.Thread(target=server.serve_forever)
+    server_thread.daemon = True
+    server_thread.start()
+    try:
+        # Identical concurrent requests are compiled once
+        libs = []
+        def compile_thread():
+            libs.append(epyccd.compile(source, socket_path, streaming=True))
+        threads = [threading.Thread(target=compile_thread) for _ in xrange(4)]
+        for thread in threads:
+            thread.start()
+        for thread in threads:
+            thread.join()
+        for lib in libs:
+            assert lib.fsum(10) == sum([i for i in xrange(10) if i > 5])
+        
+        stats = epyccd.get_stats(socket_path)
+        assert stats["misses"] == 1
+        assert stats["hits"] + stats["deduplicated"] == 3
+
+    finally:
+        server.shutdown()
+        server.server_close()
+
+    # Falls back to compiling locally without server
+    lib = epyccd.compile(source, socket_path)
+    assert lib.fsum(10) == sum([i for i in xrange(10) if i > 5])
+
+    # Linked libraries can't be sent to the server
+    raised = False
+    try:
+        epyccd.compile("float f(int n) { return fsum(n); }", socket_path, libs=[lib])
+    except ValueError:
+        raised = True
+    assert raised, "Compile server with libs didn't raise"
+
+def test_counters():
+    lib = epycc.epycc_compile(source, instrument=True)
+
+    assert lib.fsum(10) == sum([i for i in xrange(10) if i > 5])
+    assert lib.fsum(3) == 0
+
+    counters = dict([((info.function, info.block), lib.counters[info.index])
+        for info in lib.counter_info])
+    lines = dict([((info.function, info.block), info.line)
+        for info in lib.counter_info])
+
+    # Function entry counts calls
+    assert counters[("fsum", "entry")] == 2
+    assert lines[("fsum", "entry")] == 2
+    # Loop body counts iterations of both calls
+    assert counters[("fsum", "forbody")] == 10 + 3
+    assert lines[("fsum", "forbody")] == 4
+    # Then block counts the iterations that took the branch
+    assert counters[("fsum", "ifthen")] == 4
+    assert lines[("fsum", "ifthen")] == 5
+
+    lib.counters[:] = 0
+    assert all([counter == 0 for counter in lib.counters])
+
+    # Non instrumented libraries have no counters
+    lib = epycc.epycc_compile(source)
+    assert lib.counters is None
+    assert lib.counter_info == []
+
+def test_profile():
+    lib = epycc.epycc_compile(source, instrument=True)
+    for i in xrange(100):
+        lib.fsum(i)
+
+    profile = lib.get_profile()
+    assert profile["functions"]["fsum"]["entry_count"] == 100
+
+    # Profiles roundtrip through disk
+    profile_filepath = os.path.join(epycc_dirpath, "_out", "test_profile.json")
+    epycc.save_profile(profile, profile_filepath)
+    assert epycc.load_profile(profile_filepath) == profile
+
+    opt_lib = lib.reoptimize_with_profile()
+    assert "branch_weights" in opt_lib.ir
+    assert "function_entry_count" in opt_lib.ir
+    assert "ProfileSummary" in opt_lib.ir
+    assert opt_lib.counters is None
+    for i in xrange(20):
+        assert opt_lib.fsum(i) == lib.fsum(i)
+
+    # Profiles from a different source are ignored
+    other_lib = epycc.epycc_compile(source + "\n", profile=profile)
+    assert "branch_weights" not in other_lib.ir
+
+def test_latency():
+    lib = epycc.epycc_compile(source + """
+        float fsum_array(float a[], int count) {
+            float s = 0.0f;
+            for (int i = 0; i < count; ++i) {
+                s += a[i];
+            }
+            return s;
+        }
+    """, latency=True)
+
+    for i in xrange(50):
+        assert lib.fsum(i) == sum([j for j in xrange(i) if j > 5])
+        assert lib.fsum_array([1.0] * i, i) == i
+
+    for fn in [lib.fsum, lib.fsum_array]:
+        for stage in epycc.LatencyHistogram.stages:
+            assert fn.latency.count(stage) == 50
+        assert fn.latency.percentile(50) <= fn.latency.percentile(99)
+        summary = fn.latency.summary()
+        assert summary["total"]["count"] == 50
+
+    # The timer is monotonic integer nanoseconds, so the samples are never
+    # negative
+    timestamps = [epyccrt.latency_timer() for _ in xrange(100)]
+    assert all([isinstance(timestamp, (int, long)) for timestamp in timestamps])
+    assert timestamps == sorted(timestamps)
+
+    lib.fsum.latency.reset()
+    assert lib.fsum.latency.count() == 0
+    assert lib.fsum.latency.percentile(50) is None
+
+    # Latency is opt-in
+    lib = epycc.epycc_compile(source)
+    assert lib.fsum.latency is None
+
+def test_close():
+    lib = epycc.epycc_compile(source)
+    assert lib.code_bytes > 0
+    assert len(lib.object_code) > 0
+    assert lib.fsum(10) == 30
+
+    lib.close()
+    assert lib.is_closed()
+    for fn in [lib.fsum, getattr(lib, "__raw_fsum")]:
+        try:
+            fn(10)
+            assert False, "Closed library function didn't raise"
+        except RuntimeError:
+            pass
+    # Closing twice is harmless
+    lib.close()
+
+    with epycc.epycc_compile(source) as lib:
+        assert lib.fsum(10) == 30
+    assert lib.is_closed()
+
+def test_link_libs():
+    vector_lib = epycc.epycc_compile("""
+        float fdot(float a[], float b[], int count) {
+            float s = 0.0f;
+            for (int i = 0; i < count; ++i) {
+                s += a[i] * b[i];
+            }
+            return s;
+        }
+    """)
+    # Functions of linked libraries can be called without declaring them
+    norm_lib = epycc.epycc_compile("""
+        float fnorm2(float a[], int count) {
+            return fdot(a, a, count);
+        }
+    """, libs=[vector_lib])
+    assert norm_lib.fnorm2([1.0, 2.0, 3.0], 3) == 14.0
+    # The linked functions are not exposed
+    assert not hasattr(norm_lib, "fdot")
+    
+    # Libraries that link libraries can be linked in turn, and the calls are
+    # inlined
+    distance_lib = epycc.epycc_compile("""
+        float fdistance2(float a[], float b[], int count) {
+            float d[count];
+            for (int i = 0; i < count; ++i) {
+                d[i] = a[i] - b[i];
+            }
+            return fnorm2(d, count);
+        }
+    """, libs=[norm_lib])
+    assert distance_lib.fdistance2([1.0, 2.0], [4.0, 6.0], 2) == 25.0
+    assert "call float @fnorm2" not in distance_lib.ir_optimized
+    assert "call float @fdot" not in distance_lib.ir_optimized
+
+    raised = False
+    try:
+        epycc.epycc_compile("float f(float a[], int count) { return fnorm2(a, count); }")
+    except Exception:
+        raised = True
+    assert raised, "Undeclared function didn't raise"
+
+    # Redefining a function of a linked library is an error
+    try:
+        epycc.epycc_compile("float fdot(float a[], float b[], int count) { return 0.0f; }", 
+            libs=[vector_lib])
+        assert False, "Redefined library function didn't raise"
+    except ValueError:
+        pass
+    try:
+        epycc.epycc_compile("float f(float a[], int count) { return fdot(a, a, count); }",
+            libs=[vector_lib, vector_lib])
+        assert False, "Library function defined twice didn't raise"
+    except ValueError:
+        pass
+
+def test_lib_cache():
+    other_source = "int fother(int a) { return a + 1; }"
+
+    cache = epycc.JitLibCache(1024 * 1024)
+    lib = cache.get(source)
+    assert cache.get(source) is lib
+    assert (cache.hits, cache.misses) == (1, 1)
+    # Different options are different entries
+    assert cache.get(source, instrument=True) is not lib
+
+    # Linked libraries are keyed by their source and options
+    linked_source = "float f(int n) { return fsum(n); }"
+    linked_lib = cache.get(linked_source, libs=[lib])
+    assert linked_lib.f(10) == sum([i for i in xrange(10) if i > 5])
+    assert cache.get(linked_source, libs=[epycc.epycc_compile(source)]) is linked_lib
+    assert cache.get(linked_source, libs=[cache.get(source, instrument=True)]) is not linked_lib
+
+    # A cache that only fits one library evicts and closes the least recently
+    # used
+    cache = epycc.JitLibCache(1)
+    lib = cache.get(source)
+    other_lib = cache.get(other_source)
+    assert lib.is_closed()
+    assert other_lib.fother(1) == 2
+    assert cache.total_bytes == other_lib.code_bytes + other_lib.data_bytes
+
+    cache.clear()
+    assert other_lib.is_closed()
+    assert cache.total_bytes == 0
+
+def test_self_hosted_lexer():
+    lexer = epycc.get_c99_lexer()
+    text = "int a = 0x1f + 1.5e3f; // comment\n"
+    tokens = [(token_kind, text[start:end]) for token_kind, start, end in lexer.scan(text)]
+    assert "".join([value for _, value in tokens]) == text
+    assert [(token_kind, value) for token_kind, value in tokens if token_kind != "whitespace"] == [
+        ("keyword", "int"), ("identifier", "a"), ("punctuator", "="), 
+        ("integer-constant", "0x1f"), ("punctuator", "+"), 
+        ("floating-constant", "1.5e3f"), ("punctuator", ";"), 
+        ("comments", "// comment")
+    ]
+
+    # Both lexers generate the same code
+    lib = epycc.epycc_compile(source, self_hosted_lexer=True)
+    assert lib.ir == epycc.epycc_compile(source).ir
+    assert lib.fsum(10) == 30
+
+def test_streaming():
+    # Streaming generates the same code as generating from the full tree, also
+    # with multiple external declarations referencing previous ones
+    multiple_source = source + """
+        struct s { int i; float f; };
+        int fcall(int a) { return fsum(a) + 1; }
+    """
+    for s in [source, multiple_source]:
+        lib = epycc.epycc_compile(s, streaming=True)
+        assert lib.ir == epycc.epycc_compile(s).ir
+        assert lib.fsum(10) == 30
+
+    lib = epycc.epycc_compile(multiple_source, streaming=True, self_hosted_lexer=True)
+    assert lib.fcall(10) == 31
+
+def test_arena():
+    arena_source = """
+        int fvla(int a) {
+            int arr[a];
+            // Runtime sized arrays are allocated on first use, make sure it's
+            // in this scope and not in the loop's
+            arr[0] = 0;
+            for (int i = 0; i < a; ++i) {
+                arr[i] = i;
+            }
+            int s = 0;
+            for (int i = 0; i < a; ++i) {
+                s += arr[i];
+            }
+            return s;
+        }
+        int fcall(int a) { 
+            int arr[a];
+            arr[0] = fvla(a);
+            return arr[0];
+        }
+    """
+    lib = epycc.epycc_compile(arena_source, arena=True)
+    assert "epycc_arena_alloc" in lib.ir
+    # Uses the per-thread arena by default
+    assert lib.fvla(10) == 45
+    assert epycc.get_thread_arena().peak >= 10 * 4
+
+    arena = epycc.Arena(1024)
+    lib.arena = arena
+    assert lib.fcall(10) == 45
+    # Scopes release their allocations
+    assert arena.used == 0
+    assert arena.peak == 2 * 48
+    # Exhausted arenas fall back to the stack
+    assert lib.fvla(1000) == sum(xrange(1000))
+    assert arena.peak == 2 * 48
+
+    # Arenas can be kept across calls and reset manually
+    arena = epycc.Arena(1024, reset_per_call=False)
+    lib.arena = arena
+    assert lib.fvla(10) == 45
+    assert arena.used == 0
+    arena.reset()
+
+    # Raw functions take the arena as last parameter, None uses the stack
+    raw_fvla = getattr(lib, "__raw_fvla")
+    assert raw_fvla(10, arena.address) == 45
+    assert raw_fvla(10, None) == 45
+
+    # Without arena the arrays are allocated in the stack
+    lib = epycc.epycc_compile(arena_source)
+    assert "epycc_arena_alloc" not in lib.ir
+    assert lib.fcall(10) == 45
+
+def test_vla_hoisting():
+    vla_source = """
+        float fhoist(int n, int count) {
+            float s = 0.0f;
+            for (int i = 0; i < count; ++i) {
+                float tmp[n];
+                tmp[0] = i;
+                for (int j = 1; j < n; ++j) {
+                    tmp[j] = tmp[j - 1] + 1.0f;
+                }
+                s += tmp[n - 1];
+            }
+            return s;
+        }
+        float fvariant(int count) {
+            float s = 0.0f;
+            for (int i = 0; i < count; ++i) {
+                // Not hoisted, the size changes every iteration
+                float tmp[i + 1];
+                tmp[i] = i;
+                s += tmp[i];
+            }
+            return s;
+        }
+        float fcond(int n, int count) {
+            float s = 0.0f;
+            for (int i = 0; i < count; ++i) {
+                if (n > 0) {
+                    // Not hoisted, only allocated when n is positive
+                    float tmp[n];
+                    tmp[0] = i;
+                    s += tmp[0];
+                }
+            }
+            return s;
+        }
+        float fbreak(int n, int count) {
+            float s = 0.0f;
+            for (int i = 0; i < count; ++i) {
+                if (n <= 0) {
+                    break;
+                }
+                // Not hoisted, not reached when n is not positive
+                float tmp[n];
+                tmp[0] = i;
+                s += tmp[0];
+            }
+            return s;
+        }
+    """
+    def expected_fhoist(n, count):
+        return float(sum([i + n - 1 for i in xrange(count)]))
+
+    lib = epycc.epycc_compile(vla_source)
+    hoisted_lib = epycc.epycc_compile(vla_source, hoist_vlas=True)
+    assert lib.ir != hoisted_lib.ir
+    for l in [lib, hoisted_lib]:
+        assert l.fhoist(10, 20) == expected_fhoist(10, 20)
+        assert l.fvariant(20) == float(sum(xrange(20)))
+        # The size is never evaluated when the loop doesn't run
+        assert l.fhoist(-1, 0) == 0.0
+        assert l.fcond(-1, 20) == 0.0
+        assert l.fcond(1, 20) == float(sum(xrange(20)))
+        assert l.fbreak(-1, 20) == 0.0
+        assert l.fbreak(1, 20) == float(sum(xrange(20)))
+
+    # Hoisted arrays are allocated once per loop
+    hoisted_lib = epycc.epycc_compile(vla_source, hoist_vlas=True, arena=True)
+    hoisted_lib.arena = epycc.Arena(1024 * 1024)
+    assert hoisted_lib.fhoist(10, 1000) == expected_fhoist(10, 1000)
+    assert hoisted_lib.arena.peak == 48
+
+    # Only arrays above the threshold are allocated from the arena
+    lib = epycc.epycc_compile(vla_source, vla_heap_threshold=1024)
+    lib.arena = epycc.Arena(1024 * 1024)
+    assert lib.fhoist(10, 20) == expected_fhoist(10, 20)
+    assert lib.arena.peak == 0
+    assert lib.fhoist(1000, 20) == expected_fhoist(1000, 20)
+    assert lib.arena.peak == 4000
+
+def test_strings():
+    string_source = """
+        int fcount(char s[], int count, char c) {
+            int n = 0;
+            for (int i = 0; i < count; ++i) {
+                if (s[i] == c) {
+                    ++n;
+                }
+            }
+            return n;
+        }
+        void fupper(unsigned char s[], int count) {
+            for (int i = 0; i < count; ++i) {
+                if ((s[i] >= 'a') && (s[i] <= 'z')) {
+                    s[i] = s[i] - 'a' + 'A';
+                }
+            }
+        }
+        int flength(char s[]) {
+            int i = 0;
+            while (s[i] != '\\0') {
+                ++i;
+            }
+            return i;
+        }
+        int fliteral() {
+            return flength("tab\\t, newline\\n, hex \\x41") + flength("");
+        }
+    """
+    lib = epycc.epycc_compile(string_source)
+    assert lib.fliteral() == len("tab\t, newline\n, hex \x41")
+
+    # Byte buffers are passed without copying
+    text = "abracadabra"
+    assert lib.fcount(text, len(text), "a") == 5
+    # Read-only buffers are copied unless wrapped, so C code can't modify them
+    lib.fupper(text, len(text))
+    assert text == "abracadabra"
+    assert lib.fcount(epycc.ReadOnlyBuffer(text), len(text), "a") == 5
+    buf = bytearray(text)
+    assert lib.fcount(buf, len(buf), "b") == 2
+    lib.fupper(buf, len(buf))
+    assert buf == bytearray(text.upper())
+
+    filepath = os.path.join(epycc_dirpath, "_out", "test_strings.txt")
+    with open(filepath, "wb") as f:
+        f.write(text * 1000)
+    with open(filepath, "rb") as f:
+        m = mmap.mmap(f.fileno(), 0, access=mmap.ACCESS_READ)
+        assert lib.fcount(m, len(m), "r") == 2000
+        assert lib.fcount(epycc.ReadOnlyBuffer(m), len(m), "r") == 2000
+        m.close()
+    with open(filepath, "r+b") as f:
+        m = mmap.mmap(f.fileno(), 0)
+        lib.fupper(m, len(m))
+        m.close()
+    with open(filepath, "rb") as f:
+        assert f.read() == text.upper() * 1000
+
+    # Lists are still copied in and out
+    l = [ord(c) for c in text]
+    lib.fupper(l, len(l))
+    assert l == [ord(c) for c in text.upper()]
+
+def test_pickle():
+    lib = epycc.epycc_compile(source, instrument=True)
+    s = cPickle.dumps(lib, cPickle.HIGHEST_PROTOCOL)
+    # The pickle doesn't contain the IR, only the object code
+    assert len(s) < len(lib.ir) + len(lib.object_code)
+    loaded_lib = cPickle.loads(s)
+    assert loaded_lib.ir is None
+    assert loaded_lib.fsum(10) == lib.fsum(10)
+    # The counters are per library
+    counters = dict([((info.function, info.block), loaded_lib.counters[info.index])
+        for info in loaded_lib.counter_info])
+    assert len(loaded_lib.counter_info) == len(lib.counter_info)
+    assert counters[("fsum", "entry")] == 1
+    loaded_lib.close()
+    lib.close()
+
+pool_source = """
+void fscale(float a[], int count, float f) {
+    for (int i = 0; i < count; ++i) {
+        a[i] = a[i] * f;
+    }
+}
+float fsum_array(float a[], int count) {
+    float s = 0.0f;
+    for (int i = 0; i < count; ++i) {
+        s += a[i];
+    }
+    return s;
+}
+"""
+
+def test_pool():
+    lib = epycc.epycc_compile(pool_source)
+    chunk = 256
+    num_chunks = 4
+    arr = multiprocessing.sharedctypes.RawArray(ctypes.c_float, chunk * num_chunks)
+    for i in xrange(len(arr)):
+        arr[i] = float(i % 8)
+
+    with epycc.JitPool(lib, 2, dict(arr=arr)) as pool:
+        # Each worker scales its own chunk of the shared array in place
+        pool.map("fscale", [(epycc.SharedArg("arr", i * chunk), chunk, 2.0) for i in xrange(num_chunks)])
+        assert arr[:8] == [float(i * 2) for i in xrange(8)]
+        assert arr[-1] == 14.0
+        assert pool.apply("fsum_array", epycc.SharedArg("arr"), len(arr)) == sum(arr)
+        res = pool.apply_async("fsum_array", [1.0, 2.0, 3.0], 3)
+        assert res.get() == 6.0
+
+    # ctypes arrays are also passed without copying in the parent
+    lib.fscale(arr, len(arr), 0.5)
+    assert arr[:8] == [float(i) for i in xrange(8)]
+
+def test_build():
+    out_dirpath = os.path.join(epycc_dirpath, "_out")
+    epycc.epycc_build(pool_source, os.path.join(out_dirpath, "test_build_ext.so"))
+    sys.path.insert(0, out_dirpath)
+    try:
+        import test_build_ext
+    finally:
+        sys.path.remove(out_dirpath)
+
+    # Arrays are passed through the buffer protocol, in place
+    a = (ctypes.c_float * 4)(1.0, 2.0, 3.0, 4.0)
+    test_build_ext.fscale(a, len(a), 2.0)
+    assert list(a) == [2.0, 4.0, 6.0, 8.0]
+    assert test_build_ext.fsum_array(a, len(a)) == 20.0
+    try:
+        test_build_ext.fsum_array([1.0], 1)
+        assert False, "List argument didn't raise"
+    except TypeError:
+        pass
+    # Buffers of the same item size but a different type are rejected
+    try:
+        test_build_ext.fsum_array((ctypes.c_int * 4)(), 4)
+        assert False, "Wrong buffer type didn't raise"
+    except TypeError:
+        pass
+    # Floats are not truncated to integers
+    try:
+        test_build_ext.fsum_array(a, 2.5)
+        assert False, "Float integer argument didn't raise"
+    except TypeError:
+        pass
+
+    # Python 2 mmaps only have the old-style buffer interface, char arrays
+    # accept them same as the ctypes wrappers
+    epycc.epycc_build("""
+        int fcount(char s[], int count, char c) {
+            int n = 0;
+            for (int i = 0; i < count; ++i) {
+                n += (s[i] == c);
+            }
+            return n;
+        }
+        void fupper(char s[], int count) {
+            for (int i = 0; i < count; ++i) {
+                if ((s[i] >= 'a') && (s[i] <= 'z')) {
+                    s[i] = s[i] - 'a' + 'A';
+                }
+            }
+        }
+    """, os.path.join(out_dirpath, "test_build_bytes_ext.so"))
+    sys.path.insert(0, out_dirpath)
+    try:
+        import test_build_bytes_ext
+    finally:
+        sys.path.remove(out_dirpath)
+
+    text = "abracadabra"
+    filepath = os.path.join(out_dirpath, "test_build.txt")
+    with open(filepath, "wb") as f:
+        f.write(text * 1000)
+    with open(filepath, "rb") as f:
+        m = mmap.mmap(f.fileno(), 0, access=mmap.ACCESS_READ)
+        assert test_build_bytes_ext.fcount(m, len(m), "r") == 2000
+        m.close()
+    with open(filepath, "r+b") as f:
+        m = mmap.mmap(f.fileno(), 0)
+        test_build_bytes_ext.fupper(m, len(m))
+        # Other item types still need the new-style buffer interface
+        try:
+            test_build_ext.fsum_array(m, 1)
+            assert False, "mmap float argument didn't raise"
+        except TypeError:
+            pass
+        m.close()
+    with open(filepath, "rb") as f:
+        assert f.read() == text.upper() * 1000
+
+def test_save():
+    lib = epycc.epycc_compile(pool_source, instrument=True, latency=True)
+    filepath = os.path.join(epycc_dirpath, "_out", "test_save.so")
+    lib.save(filepath)
+    assert os.path.exists(filepath + ".json")
+
+    saved_lib = epyccrt.load_lib(filepath)
+    l = [1.0, 2.0, 3.0]
+    saved_lib.fscale(l, len(l), 2.0)
+    assert l == [2.0, 4.0, 6.0]
+    assert saved_lib.fsum_array(l, len(l)) == lib.fsum_array(l, len(l))
+    assert saved_lib.fsum_array.latency.count() == 1
+    counters = dict([((info.function, info.block), saved_lib.counters[info.index])
+        for info in saved_lib.counter_info])
+    assert counters[("fsum_array", "entry")] == 1
+
+    saved_lib.close()
+    try:
+        saved_lib.fsum_array(l, len(l))
+        assert False, "Call after close didn't raise"
+    except RuntimeError:
+        pass
+    lib.close()
+
+
+class ArrayView(object):
+    """
+    Minimal numpy-like strided view over a ctypes array, exposing the numpy
+    array interface
+    """
+    def __init__(self, buf, shape, strides, offset = 0, typestr = None, read_only = False):
+        if (typestr is None):
+            typestr = ("<" if (sys.byteorder == "little") else ">") + "f4"
+        # Keep the buffer alive while the view is alive
+        self.buf = buf
+        self.__array_interface__ = dict(version=3, shape=shape, strides=strides,
+            typestr=typestr, data=(ctypes.addressof(buf) + offset, read_only))
+
+def test_strided():
+    lib = epycc.epycc_compile("""
+        float fsum2d(float a[*][*], int rows, int cols) {
+            float s = 0.0f;
+            for (int i = 0; i < rows; ++i) {
+                for (int j = 0; j < cols; ++j) {
+                    s += a[i][j];
+                }
+            }
+            return s;
+        }
+        void fscale_strided(float a[*], int count, float scale) {
+            for (int i = 0; i < count; ++i) {
+                a[i] *= scale;
+            }
+        }
+        float fsum2d_twice(float a[*][*], int rows, int cols) {
+            return 2.0f * fsum2d(a, rows, cols);
+        }
+    """)
+    # 3x4 C-contiguous matrix
+    buf = (ctypes.c_float * 12)(*range(12))
+    matrix = ArrayView(buf, (3, 4), None)
+    assert lib.fsum2d(matrix, 3, 4) == sum(range(12))
+    # Transposed, ie arr.T
+    transposed = ArrayView(buf, (4, 3), (4, 16))
+    assert lib.fsum2d(transposed, 4, 3) == sum(range(12))
+    # Column 1 as a 3x1 slice, ie arr[:, 1:2]
+    column = ArrayView(buf, (3, 1), (16, 4), offset=4)
+    assert lib.fsum2d(column, 3, 1) == 1 + 5 + 9
+    assert lib.fsum2d_twice(column, 3, 1) == 2 * (1 + 5 + 9)
+
+    # Column 1, ie arr[:, 1], modified in place without copying
+    lib.fscale_strided(ArrayView(buf, (3,), (16,), offset=4), 3, 2.0)
+    assert list(buf) == [0, 2, 2, 3, 4, 10, 6, 7, 8, 18, 10, 11]
+    # Reversed, ie arr[::-1]
+    row = (ctypes.c_float * 3)(1.0, 2.0, 3.0)
+    lib.fscale_strided(ArrayView(row, (3,), (-4,), offset=8), 2, 10.0)
+    assert list(row) == [1.0, 20.0, 30.0]
+
+    # The raw function takes the base pointer and the byte strides
+    assert lib.__raw_fsum2d(ctypes.addressof(buf), 16, 4, 3, 4) == sum(buf)
+
+    try:
+        lib.fscale_strided(ArrayView(row, (3,), None, typestr="=i4"), 3, 2.0)
+        assert False, "Wrong item type didn't raise"
+    except TypeError:
+        pass
+    try:
+        foreign_byteorder = ">" if (sys.byteorder == "little") else "<"
+        lib.fscale_strided(ArrayView(row, (3,), None, typestr=foreign_byteorder + "f4"), 3, 2.0)
+        assert False, "Wrong byte order didn't raise"
+    except TypeError:
+        pass
+    try:
+        lib.fscale_strided(ArrayView(row, (3,), None, read_only=True), 3, 2.0)
+        assert False, "Read-only array didn't raise"
+    except ValueError:
+        pass
+    try:
+        lib.fscale_strided(matrix, 3, 2.0)
+        assert False, "Wrong number of dimensions didn't raise"
+    except ValueError:
+        pass
+
+    try:
+        import numpy
+        arr = numpy.arange(12, dtype=numpy.float32).reshape(3, 4)
+        assert lib.fsum2d(arr.T, 4, 3) == arr.sum()
+        lib.fscale_strided(arr[:, 1], 3, 2.0)
+        assert arr[2, 1] == 18.0
+    except ImportError:
+        pass
+
+    lib.close()
+
+
+if (__name__ == "__main__"):
+    sys.stderr = sys.stdout
+
+    failures = 0
+    tests = [(name, fn) for name, fn in sorted(globals().items()) if name.startswith("test_")]
+    for name, fn in tests:
+        print "testing", name
+        try:
+            fn()
+        except Exception as e:
+            traceback.print_exc()
+            failures += 1
+
+    print "Ran", len(tests), "tests,", failures, "failures"